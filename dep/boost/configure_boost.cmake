@@ -29,7 +29,7 @@ set(Boost_ADDITIONAL_VERSIONS
   "1.59" "1.59.0"
   "1.60" "1.60.0"
 )
-find_package(Boost 1.58 REQUIRED
+find_package(Boost 1.70 REQUIRED
   system
   context
   coroutine
@@ -1,4 +1,3 @@
-
 //  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
 //     Distributed under the Boost Software License, Version 1.0
 //       (See accompanying file LICENSE_1_0.txt or copy at
@@ -7,20 +6,43 @@
 #ifndef INCLUDED_AWAITIFY_HPP
 #define INCLUDED_AWAITIFY_HPP
 
+#include <new>
+#include <mutex>
+#include <tuple>
+#include <chrono>
+#include <future>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
 #include <memory>
+#include <functional>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include <exception>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
 #include <type_traits>
 #include <boost/optional.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/detail/exception.hpp>
 #include <boost/coroutine2/coroutine.hpp>
 
+#include "awaitify/future.hpp"
+#include "awaitify/work_stealing_executor.hpp"
+
 #if !defined(AWAITIFY_PROVIDE_FUTURE_TYPE) || \
-    !defined(AWAITIFY_PROVIDE_PROMISED_TYPE)
+    !defined(AWAITIFY_PROVIDE_PROMISE_TYPE)
   // Provide the boost future_t and promise_t implementation
   // when no custom type is used.
   #define BOOST_THREAD_PROVIDES_FUTURE
   #define BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
   #define BOOST_THREAD_PROVIDES_FUTURE_WHEN_ALL_WHEN_ANY
   #include <boost/thread/future.hpp>
-#endif // AWAITIFY_PROVIDE_FUTURE_TYPE || AWAITIFY_PROVIDE_PROMISED_TYPE
+#endif // AWAITIFY_PROVIDE_FUTURE_TYPE || AWAITIFY_PROVIDE_PROMISE_TYPE
 
 #ifndef AWAITIFY_PROVIDE_EXECUTOR_TYPE
   #include <boost/asio/io_service.hpp>
@@ -35,11 +57,31 @@
   #define await( EXPR ) _awaitify_impl_( EXPR )
 #endif // AWAITIFY_NO_KEYWORD_MACRO
 
+// Define AWAITIFY_TASK_BUFFER_SIZE to change the maximal size in bytes
+// of tasks which are stored inline at the top of the coroutine stack,
+// bigger tasks are stored on the heap.
+#ifndef AWAITIFY_TASK_BUFFER_SIZE
+  #define AWAITIFY_TASK_BUFFER_SIZE 256
+#endif // AWAITIFY_TASK_BUFFER_SIZE
+
+// Define AWAITIFY_REQUIRE_INLINE_TASKS to reject tasks at compile-time
+// which aren't stored inline at the top of the coroutine stack.
+
+// Define AWAITIFY_CONTEXT_BUFFER_SIZE to change the maximal size in bytes
+// of contexts, including their in-place result, which are placed at
+// the top of their coroutine stack, bigger contexts are stored on the heap.
+#ifndef AWAITIFY_CONTEXT_BUFFER_SIZE
+  #define AWAITIFY_CONTEXT_BUFFER_SIZE 512
+#endif // AWAITIFY_CONTEXT_BUFFER_SIZE
+
 namespace awf {
 // Provide your own future_t type through
 // defining AWAITIFY_PROVIDE_FUTURE_TYPE.
 // The interface of the given type needs to match
 // the one from boost::future.
+// Define it as `awf::future` and AWAITIFY_PROVIDE_PROMISE_TYPE
+// as `awf::promise` to use the lightweight futures
+// from "awaitify/future.hpp".
 #ifndef AWAITIFY_PROVIDE_FUTURE_TYPE
   /// \brief Future type from boost
   template<typename T>
@@ -68,6 +110,8 @@ namespace awf {
 // defining AWAITIFY_PROVIDE_EXECUTOR_TYPE.
 // The interface of the given type needs to match
 // the one from boost::asio::io_service.
+// Define it as `awf::work_stealing_executor` to use the executor
+// from "awaitify/work_stealing_executor.hpp".
 #ifndef AWAITIFY_PROVIDE_EXECUTOR_TYPE
   /// \brief Executor type from boost
   using executor = boost::asio::io_service;
@@ -81,49 +125,807 @@ namespace awf {
   executor& system_scheduler();
 #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
 
+  /// \brief Configuration of the per-thread coroutine stack pool
+  struct stack_pool_options
+  {
+    /// The size in bytes of every coroutine stack
+    std::size_t stack_size;
+    /// The maximal count of unused stacks which are kept per thread,
+    /// a depth of 0 disables the pooling.
+    std::size_t depth;
+  };
+
+  /// \brief Returns the current configuration of the stack pool
+  stack_pool_options stack_pool_configuration();
+
+  /// \brief Configures the stack pool,
+  /// pooled stacks which don't match the new size are released lazily.
+  void configure_stack_pool(stack_pool_options const& options);
+
+  /// \brief Describes how suspended contexts are resumed
+  enum class resume_mode
+  {
+    /// Every resumption is posted to the scheduler
+    post,
+    /// Contexts are resumed directly when their future is completed
+    /// from a thread of the scheduler, other threads still post.
+    dispatch
+  };
+
+  /// \brief Configuration of the context resumption
+  struct resume_options
+  {
+    resume_mode mode;
+    /// The maximal count of directly resumed contexts which are nested
+    /// on one thread, deeper resumptions are posted.
+    std::size_t max_depth;
+    /// Posts resumptions to the worker the context ran on last,
+    /// requires an executor with per-thread queues such as
+    /// awf::work_stealing_executor and is ignored otherwise.
+    bool affinity = true;
+  };
+
+  /// \brief Returns the current configuration of the context resumption
+  resume_options resume_configuration();
+
+  /// \brief Configures the context resumption
+  void configure_resume(resume_options const& options);
+
+  /// \brief Counters of the context resumption
+  struct resume_counters
+  {
+    /// Resumptions of suspended contexts
+    std::uint64_t resumes;
+    /// Resumptions on another thread than the context ran on before
+    std::uint64_t migrations;
+    /// Ready awaits which yielded since the context exhausted its budget
+    std::uint64_t preemptions;
+  };
+
+  /// \brief Returns the accumulated counters of the context resumption,
+  /// the migration rate is the difference of two samples over time.
+  resume_counters resume_statistics();
+
+  /// \brief Returns the count of contexts which are resumed directly
+  /// on the calling thread, it's bounded by resume_options::max_depth.
+  std::size_t resume_depth() noexcept;
+
+  /// \brief Priority class of a context, its resumptions inherit it
+  enum class priority
+  {
+    /// Runs in front of the normal resumptions of the executor
+    high,
+    normal,
+    /// Is deferred behind the pending work of the executor
+    low
+  };
+
+  /// \brief Starvation protection of the priority classes
+  struct priority_options
+  {
+    /// The maximal count of high priority tasks which are run
+    /// in front of a single normal resumption.
+    std::size_t high_burst;
+    /// The count of times a low priority task is requeued
+    /// behind the pending work of the executor.
+    std::size_t low_deferrals;
+  };
+
+  /// \brief Returns the current starvation protection
+  priority_options priority_configuration();
+
+  /// \brief Configures the starvation protection of the priority classes
+  void configure_priorities(priority_options const& options);
+
+  /// \brief Queue wait latency of a priority class
+  struct priority_counters
+  {
+    /// Tasks which were taken from the queue
+    std::uint64_t dequeued;
+    std::chrono::nanoseconds total_wait;
+    std::chrono::nanoseconds max_wait;
+  };
+
+  /// \brief Returns the accumulated queue wait latency of the priority class,
+  /// spawns of normal priority aren't measured.
+  priority_counters priority_statistics(priority level);
+
+  /// \brief Run budget of a context between two suspensions
+  ///
+  /// Awaiting a ready future doesn't suspend the context, so a context
+  /// which rarely waits keeps its thread. Once the budget is exhausted
+  /// the next ready await yields to the pending work of the executor.
+  /// Both limits are disabled by default, a run time limit reads
+  /// the clock on every resumption and ready await.
+  struct budget_options
+  {
+    /// The count of consecutive ready awaits which don't yield,
+    /// 0 disables the limit.
+    std::size_t ready_awaits;
+    /// The run time since the context was resumed, 0 disables the limit
+    std::chrono::microseconds run_time;
+  };
+
+  /// \brief Returns the current run budget of contexts
+  budget_options budget_configuration();
+
+  /// \brief Configures the run budget of contexts
+  void configure_budget(budget_options const& options);
+
+  /// \brief Describes how spawns beyond the live context limit are handled
+  enum class admission_policy
+  {
+    /// Spawns from a context suspend it until a context completed,
+    /// other threads are blocked. Contexts which spawn children
+    /// while holding the last slots can't make progress!
+    wait,
+    /// Spawns throw an awf::admission_error
+    fail
+  };
+
+  /// \brief Configuration of the admission of spawned contexts
+  struct admission_options
+  {
+    /// The maximal count of live contexts, 0 disables the limit.
+    /// Contexts spawned without a limit aren't counted against it.
+    std::size_t max_contexts;
+    admission_policy policy;
+  };
+
+  /// \brief Returns the current admission of spawned contexts
+  admission_options admission_configuration();
+
+  /// \brief Configures the admission of spawned contexts,
+  /// raising the limit admits waiting spawns.
+  void configure_admission(admission_options const& options);
+
+  /// \brief Counters of the admission of spawned contexts
+  struct admission_counters
+  {
+    /// Spawned contexts which weren't completed yet,
+    /// only counted while a limit is configured
+    std::size_t live;
+    /// Spawns which suspended their context until they were admitted
+    std::uint64_t awaited;
+    /// Spawns which blocked their thread until they were admitted
+    std::uint64_t blocked;
+    /// Spawns which were rejected
+    std::uint64_t rejected;
+  };
+
+  /// \brief Returns the accumulated counters of the admission
+  admission_counters admission_statistics();
+
+  /// \brief Thrown by spawns beyond the live context limit
+  /// under admission_policy::fail.
+  class admission_error
+    : public std::runtime_error
+  {
+  public:
+    admission_error()
+      : std::runtime_error("The live context limit was reached!") { }
+  };
+
+  /// \brief Configuration of contexts spawned through spawn_detached()
+  struct detached_options
+  {
+    /// Invoked with the exceptions which escape detached contexts,
+    /// std::terminate is called when no handler is set.
+    void (*on_exception)(std::exception_ptr);
+  };
+
+  /// \brief Returns the current configuration of detached contexts
+  detached_options detached_configuration();
+
+  /// \brief Configures the handling of detached contexts
+  void configure_detached(detached_options const& options);
+
+  namespace detail {
+    /// Passes the exception of a detached context to the handler
+    void handle_detached_exception(std::exception_ptr exception);
+  } // namespace detail
+
+  /// \brief Configuration of the idle strategy of the scheduler threads
+  ///
+  /// A thread which ran out of work polls busily for the spin duration,
+  /// then polls while yielding for the yield duration before it parks
+  /// in the kernel. Spinning trades CPU time for lower wakeup latency.
+  struct idle_options
+  {
+    std::chrono::microseconds spin;
+    std::chrono::microseconds yield;
+  };
+
+  /// \brief Returns the current idle strategy
+  idle_options idle_configuration();
+
+  /// \brief Configures the idle strategy of the runtime threads
+  /// and the threads of the work-stealing executor.
+  void configure_idle(idle_options const& options);
+
+  /// \brief Counters of the idle strategy
+  struct idle_counters
+  {
+    /// Unsuccessful polls while spinning
+    std::uint64_t spins;
+    /// Unsuccessful polls while yielding
+    std::uint64_t yields;
+    /// Times a thread parked in the kernel
+    std::uint64_t parks;
+    /// Parked threads which were woken up by work
+    std::uint64_t wakeups;
+  };
+
+  /// \brief Returns the accumulated counters of the idle strategy
+  idle_counters idle_statistics();
+
+  /// \brief Configuration of the runtime threads
+  struct runtime_options
+  {
+    /// The count of worker threads, 0 selects the hardware concurrency
+    std::size_t threads = 0;
+    /// Pins the n-th worker to the n-th CPU the process may run on
+    bool pin_threads = false;
+    /// Prefix of the thread names, the worker index is appended
+    std::string name = "awf-worker";
+  };
+
+  /// \brief Owns the worker threads which run an executor,
+  /// the system scheduler by default.
+  ///
+  /// The executor is kept alive through a work guard while the runtime
+  /// is started, the destructor stops the executor and joins the workers.
+  /// Sleeps and deadlines don't require the system scheduler, the timer
+  /// wheel is driven by its own thread and resumes expired contexts
+  /// on their executor.
+  class runtime
+  {
+    executor& scheduler_;
+    runtime_options options_;
+    std::unique_ptr<executor::work> work_;
+    std::vector<std::thread> threads_;
+
+  public:
+  #ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
+    explicit runtime(runtime_options options = {});
+  #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
+    runtime(executor& scheduler, runtime_options options = {});
+    ~runtime();
+    runtime(runtime const&) = delete;
+    runtime& operator= (runtime const&) = delete;
+
+    /// Restarts the executor and spawns the worker threads, throws
+    /// a std::length_error when it can't be run by that many threads.
+    void start();
+    /// Stops the executor, pending handlers aren't invoked anymore
+    void stop();
+    /// Waits until all worker threads returned
+    void join();
+
+    /// Returns the count of worker threads
+    std::size_t size() const noexcept { return threads_.size(); }
+    runtime_options const& options() const noexcept { return options_; }
+  };
+
+  class shard;
+  class sharded_runtime;
+
+  namespace detail {
+    class shard_queue;
+    class scheduler_queue;
+
+    /// Returns the multi-level queue of the executor
+    scheduler_queue& scheduler_queue_of(executor& scheduler);
+    /// Queues the task in the priority class of the executor
+    void enqueue_prioritized(scheduler_queue& queue, priority level,
+                             executor_task* task);
+    /// Runs queued high priority tasks of the executor
+    /// in front of normal work.
+    void run_high_priority(scheduler_queue& queue);
+  } // namespace detail
+
+  /// \brief Returns the shard which runs on the calling thread or nullptr
+  shard* current_shard() noexcept;
+
+  /// \brief Executor of a sharded_runtime which is run by a single thread
+  ///
+  /// Contexts which were spawned on a shard are only resumed on its
+  /// thread. Functions posted from another shard of the same runtime
+  /// pass through a single-producer single-consumer queue per pair
+  /// of shards, so cross-shard calls don't lock on the hot path.
+  class shard
+  {
+    friend class sharded_runtime;
+
+    sharded_runtime* const runtime_;
+    std::size_t const index_;
+    /// The count of the shards of the runtime and of the inbox queues
+    std::size_t const count_;
+    executor scheduler_;
+    /// The queues of the messages from the other shards, by their index
+    std::unique_ptr<detail::shard_queue[]> inbox_;
+    /// Set while a drain of the inbox is posted to the scheduler
+    std::atomic<bool> draining_;
+    std::unique_ptr<executor::work> work_;
+
+    shard(sharded_runtime& runtime, std::size_t index, std::size_t count);
+
+  public:
+    ~shard();
+    shard(shard const&) = delete;
+    shard& operator= (shard const&) = delete;
+
+    /// Returns the index of the shard inside its runtime
+    std::size_t index() const noexcept { return index_; }
+    /// Returns the executor which is run by the thread of the shard
+    executor& scheduler() noexcept { return scheduler_; }
+    bool stopped() const { return scheduler_.stopped(); }
+
+    /// Returns true when called from the thread of the shard
+    bool running_in_this_thread() const noexcept
+    {
+      return current_shard() == this;
+    }
+
+    /// Schedules the function on the thread of the shard
+    template<typename Function>
+    void post(Function&& function)
+    {
+      if (running_in_this_thread())
+        scheduler_.post(std::forward<Function>(function));
+      else
+        submit(new detail::executor_task_impl<std::decay_t<Function>>(
+          std::forward<Function>(function)));
+    }
+
+  private:
+    void submit(detail::executor_task* task);
+    void arm();
+    void drain();
+  };
+
+  /// \brief Runs one independent shard per thread (thread-per-core),
+  /// the threads are pinned to distinct CPUs through
+  /// runtime_options::pin_threads.
+  /// Expired sleeps and deadlines of contexts on a shard are posted
+  /// from the driver thread of the timer wheel to their shard.
+  class sharded_runtime
+  {
+    runtime_options options_;
+    std::vector<std::unique_ptr<shard>> shards_;
+    std::vector<std::thread> threads_;
+
+  public:
+    explicit sharded_runtime(runtime_options options = {});
+    ~sharded_runtime();
+    sharded_runtime(sharded_runtime const&) = delete;
+    sharded_runtime& operator= (sharded_runtime const&) = delete;
+
+    /// Restarts the shards and spawns a thread for every shard
+    void start();
+    /// Stops the shards, pending functions aren't invoked anymore
+    void stop();
+    /// Waits until all shard threads returned
+    void join();
+
+    /// Returns the count of shards
+    std::size_t size() const noexcept { return shards_.size(); }
+    shard& operator[] (std::size_t index) noexcept { return *shards_[index]; }
+    runtime_options const& options() const noexcept { return options_; }
+  };
+
+  /// \brief Stack allocator which recycles the coroutine stacks
+  /// through a per-thread pool instead of mapping a new stack
+  /// for every execution_context.
+  class pooled_stack_allocator
+  {
+    boost::context::stack_context prepared_;
+    std::size_t reserved_;
+
+  public:
+    pooled_stack_allocator() noexcept
+      : prepared_(), reserved_(0) { }
+    /// Hands out the given stack without the reserved bytes at its top,
+    /// the stack stays owned by the caller and isn't returned to the pool.
+    pooled_stack_allocator(boost::context::stack_context prepared,
+                           std::size_t reserved) noexcept
+      : prepared_(prepared), reserved_(reserved) { }
+
+    boost::context::stack_context allocate();
+    void deallocate(boost::context::stack_context& stack) noexcept;
+  };
+
+  /// \brief Is true when the task is stored inline at the top of
+  /// the coroutine stack of its context, which requires it to fit into
+  /// AWAITIFY_TASK_BUFFER_SIZE bytes. Other tasks are stored on the heap.
+  template<typename T>
+  struct is_inline_task
+    : std::integral_constant<bool,
+        (sizeof(std::decay_t<T>) <= AWAITIFY_TASK_BUFFER_SIZE) &&
+        (alignof(std::decay_t<T>) <= alignof(std::max_align_t))> { };
+
+  /// \brief Is true when the context is placed at the top of
+  /// its coroutine stack, which requires it to fit into
+  /// AWAITIFY_CONTEXT_BUFFER_SIZE bytes. Other contexts are stored on the heap.
+  template<typename T>
+  struct is_inline_context
+    : std::integral_constant<bool,
+        (sizeof(T) <= AWAITIFY_CONTEXT_BUFFER_SIZE) &&
+        (alignof(T) <= alignof(std::max_align_t))> { };
+
   template<typename T>
   class specific_execution_context;
 
+  template<typename T>
+  class joinable_execution_context;
+
+  class execution_context;
+
+  /// \brief Owning reference to an execution_context
+  using shared_execution_context = boost::intrusive_ptr<execution_context>;
+
   class execution_context
-    : public std::enable_shared_from_this<execution_context>
   {
     using coro_t = boost::coroutines2::coroutine<void>;
+    using on_suspend_t = void(*)(void*, shared_execution_context&&);
+    using task_invoker_t = void(*)(execution_context*, void*, bool run);
 
+    std::atomic<std::size_t> references_;
     boost::optional<coro_t::push_type> push_;
     coro_t::pull_type* pull_;
+    on_suspend_t on_suspend_;
+    void* on_suspend_data_;
+    /// The thread the context ran on last, 0 before the first run
+    std::uint32_t last_thread_;
+    /// The executor worker the context ran on last plus one,
+    /// 0 when it didn't run on a worker with a local queue.
+    std::uint32_t home_worker_;
+    /// The executor which resumes the context,
+    /// nullptr for contexts of the system scheduler.
+    executor* scheduler_;
+    /// The multi-level queue of the executor,
+    /// nullptr for contexts which aren't bound to an executor.
+    detail::scheduler_queue* queue_;
+    /// The shard which resumes the context, nullptr for contexts
+    /// which aren't bound to a shard.
+    shard* shard_;
+    priority priority_;
+    /// The ready awaits and the start of the run since the last resumption
+    std::uint32_t ready_awaits_;
+    std::chrono::steady_clock::time_point resumed_at_;
+    /// True when the context holds a slot of the live context limit,
+    /// which is released after the context was destroyed.
+    bool admitted_;
+    /// True when the context is placed at the top of its stack
+    bool embedded_;
+    /// The task until it's started
+    void* task_;
+    task_invoker_t task_invoker_;
+    /// The coroutine stack and the bytes at its top which hold
+    /// the context and its task, the coroutine runs below them.
+    boost::context::stack_context stack_;
+    std::size_t reserved_;
 
   public:
-    execution_context() { }
-    virtual ~execution_context() { }
+    execution_context()
+      : references_(0), pull_(nullptr),
+        on_suspend_(nullptr), on_suspend_data_(nullptr),
+        last_thread_(0), home_worker_(0),
+        scheduler_(nullptr), queue_(nullptr), shard_(nullptr),
+        priority_(priority::normal), ready_awaits_(0), admitted_(false),
+        embedded_(false), task_(nullptr), task_invoker_(nullptr),
+        stack_(), reserved_(0) { }
+    virtual ~execution_context()
+    {
+      // The task of a context which was never started
+      if (task_)
+        task_invoker_(this, task_, false);
+    }
     execution_context(execution_context const&) = delete;
     execution_context(execution_context&&) = delete;
     execution_context& operator= (execution_context const&) = delete;
     execution_context& operator= (execution_context&&) = delete;
 
+    // Contexts which exceed AWAITIFY_CONTEXT_BUFFER_SIZE are recycled
+    // through per-thread free-lists.
+    static void* operator new (std::size_t size)
+    {
+      return detail::allocate_recycled(size);
+    }
+    static void operator delete (void* block, std::size_t size) noexcept
+    {
+      detail::deallocate_recycled(block, size);
+    }
+
+    /// \brief Slot of the live context limit which is taken before
+    /// a context is created and handed over to it.
+    class admission
+    {
+      bool held_;
+
+    public:
+      explicit admission(bool held) noexcept
+        : held_(held) { }
+      admission(admission&& right) noexcept
+        : held_(std::exchange(right.held_, false)) { }
+      admission& operator= (admission&&) = delete;
+      ~admission()
+      {
+        if (held_)
+          release_admission();
+      }
+
+      /// Hands the slot over to the caller
+      bool release() noexcept { return std::exchange(held_, false); }
+    };
+
+    /// Takes a slot of the live context limit, which is held by
+    /// the context it's passed to until the context is released.
+    /// Waits for the slot or throws an awf::admission_error
+    /// depending on the admission policy. The slot is taken before
+    /// the context is created, so waiting spawns don't hold a stack.
+    static admission admit();
+
+    /// Creates a context at the top of a coroutine stack of the pool,
+    /// the stack holds the context, its inline task and the coroutine
+    /// until the context is released. The context takes over the slot.
+    template<typename Context>
+    static boost::intrusive_ptr<Context> create(admission slot)
+    {
+      static_assert(std::is_base_of<execution_context, Context>::value,
+                    "The context isn't an execution_context!");
+      if (!is_inline_context<Context>::value)
+      {
+        boost::intrusive_ptr<Context> context(new Context());
+        context->admitted_ = slot.release();
+        return context;
+      }
+
+      auto stack = acquire_stack();
+      auto const reserved = reserve(sizeof(Context));
+      Context* context;
+      try
+      {
+        context = ::new (static_cast<char*>(stack.sp) - reserved) Context();
+      }
+      catch (...)
+      {
+        recycle_stack(stack);
+        throw;
+      }
+      context->admitted_ = slot.release();
+      context->embedded_ = true;
+      context->stack_ = stack;
+      context->reserved_ = reserved;
+      return boost::intrusive_ptr<Context>(context);
+    }
+
+    /// Sets the task whose result completes the promise of the context
     template<typename Result, typename Task>
     void set_task(Task&& task)
     {
-      weak_enter();
+      store_task<promise_entry<Result>>(std::forward<Task>(task));
+    }
+
+    /// Sets a task whose result or exception is stored in-place
+    template<typename Result, typename Task>
+    void set_joinable_task(Task&& task)
+    {
+      store_task<joinable_entry<Result>>(std::forward<Task>(task));
+    }
+
+    /// Sets a task whose result is discarded, escaping exceptions
+    /// are passed to the handler of detached contexts.
+    template<typename Task>
+    void set_detached_task(Task&& task)
+    {
+      store_task<detached_entry>(std::forward<Task>(task));
+    }
+
+    /// Creates the coroutine of the context which runs its task
+    /// and resumes it, takes over the reference of the resumer.
+    static void start(shared_execution_context context);
+
+    /// Binds the context to the given executor which resumes it
+    void bind(executor& scheduler);
+    /// Binds the context to the given shard, it's resumed on its thread only
+    void bind(shard& owner) noexcept
+    {
+      shard_ = &owner;
+      scheduler_ = &owner.scheduler();
+    }
+    /// Returns the executor which resumes the context
+    executor& scheduler() const noexcept;
+    /// Returns the multi-level queue of the executor the context is bound to
+    detail::scheduler_queue& queue() const noexcept
+    {
+      assert(queue_ &&
+             "The context isn't bound to an executor!");
+      return *queue_;
+    }
+    /// Returns the shard the context is bound to or nullptr
+    shard* owner() const noexcept { return shard_; }
+
+
+    void set_priority(priority level) noexcept { priority_ = level; }
+    priority get_priority() const noexcept { return priority_; }
+
+    /// Resumes the context and takes over the reference of the resumer
+    static void resume(shared_execution_context context);
+
+    /// Enqueues the resumption of the context on the scheduler
+    static void schedule(shared_execution_context context);
 
-      push_ = coro_t::push_type(
-        [ task = std::forward<Task>(task),
-          me = shared_from_this() ]
-        (coro_t::pull_type& pull) mutable
+    /// Resumes the context in place when the calling thread runs its shard
+    /// or executor, otherwise the resumption is enqueued on the scheduler.
+    static void resume_or_schedule(shared_execution_context context);
+
+    /// Enqueues the resumption of the context behind the pending work
+    /// of the scheduler, the context is never resumed in place.
+    static void defer(shared_execution_context context);
+
+    /// Counts a ready await against the run budget of the context,
+    /// returns true when the context has to yield.
+    bool consume_budget() noexcept;
+
+    /// Suspends the context and invokes the given callable with
+    /// the reference of the resumer after the context was left.
+    /// The callable is responsible for resuming the context later.
+    template<typename Callable>
+    void suspend(Callable& on_suspend)
+    {
+      on_suspend_ = [](void* data, shared_execution_context&& context)
       {
-        me->pull_ = &pull;
-        me->invoke(std::is_same<decltype(task()), void>{},
-          std::move(task),
-          &static_cast<specific_execution_context<Result>*>(
-            me.get())->promise_);
-      });
-      weak_leave();
+        (*static_cast<Callable*>(data))(std::move(context));
+      };
+      on_suspend_data_ = std::addressof(on_suspend);
+      suspend();
     }
-    void resume();
+
     void weak_enter();
     void weak_leave();
-    void suspend();
+
+    friend void intrusive_ptr_add_ref(execution_context* context) noexcept
+    {
+      context->references_.fetch_add(1, std::memory_order_relaxed);
+    }
+    friend void intrusive_ptr_release(execution_context* context) noexcept
+    {
+      if (context->references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        destroy(context);
+    }
 
   private:
+    void suspend();
+    static void release_admission() noexcept;
+    static void destroy(execution_context* context) noexcept;
+
+    static boost::context::stack_context acquire_stack();
+    static void recycle_stack(boost::context::stack_context& stack) noexcept;
+
+    /// Returns the bytes which are reserved at the top of the stack
+    /// for the given size, keeps the stack pointer aligned.
+    static constexpr std::size_t reserve(std::size_t size) noexcept
+    {
+      return (size + alignof(std::max_align_t) - 1) &
+             ~(alignof(std::max_align_t) - 1);
+    }
+
+    /// Returns the storage of a task of the given size, inline tasks
+    /// are stored at the top of a stack which is taken from the pool.
+    void* allocate_task(std::size_t size, bool is_inline);
+    void deallocate_task(void* task, std::size_t size, bool is_inline)
+      noexcept;
+
+    /// Stores the task with a single move or copy, the entry runs it
+    /// on the coroutine stack of the context.
+    template<typename Entry, typename Task>
+    void store_task(Task&& task)
+    {
+      using task_t = std::decay_t<Task>;
+    #ifdef AWAITIFY_REQUIRE_INLINE_TASKS
+      static_assert(is_inline_task<task_t>::value,
+                    "The task exceeds AWAITIFY_TASK_BUFFER_SIZE!");
+    #endif // AWAITIFY_REQUIRE_INLINE_TASKS
+      assert(!task_ && !push_ &&
+             "The task was set already!");
+
+      auto const storage =
+        allocate_task(sizeof(task_t), is_inline_task<task_t>::value);
+      try
+      {
+        new (storage) task_t(std::forward<Task>(task));
+      }
+      catch (...)
+      {
+        deallocate_task(storage, sizeof(task_t),
+                        is_inline_task<task_t>::value);
+        throw;
+      }
+      task_ = storage;
+      task_invoker_ = &invoke_task<Entry, task_t>;
+    }
+
+    /// Runs the stored task through the entry or only releases it
+    template<typename Entry, typename Task>
+    static void invoke_task(execution_context* self, void* storage, bool run)
+    {
+      // Releases the task after it ran or its stack was unwound
+      struct releaser
+      {
+        execution_context* self;
+        Task* task;
+
+        ~releaser()
+        {
+          task->~Task();
+          self->deallocate_task(task, sizeof(Task),
+                                is_inline_task<Task>::value);
+        }
+      } const guard{ self, static_cast<Task*>(storage) };
+
+      if (run)
+        Entry::run(self, *guard.task);
+    }
+
+    template<typename Result>
+    struct promise_entry
+    {
+      template<typename Task>
+      static void run(execution_context* self, Task& task)
+      {
+        self->invoke(std::is_same<decltype(task()), void>{},
+          std::move(task),
+          &static_cast<specific_execution_context<Result>*>(
+            self)->promise_);
+      }
+    };
+
+    template<typename Result>
+    struct joinable_entry
+    {
+      template<typename Task>
+      static void run(execution_context* self, Task& task)
+      {
+        auto& result =
+          static_cast<joinable_execution_context<Result>*>(self)->result_;
+        try
+        {
+          self->invoke(std::is_same<decltype(task()), void>{},
+                       std::move(task), &result);
+        }
+        catch (boost::context::detail::forced_unwind const&)
+        {
+          // Unwinds the stack of a context which is released suspended
+          throw;
+        }
+        catch (...)
+        {
+          result.set_exception(std::current_exception());
+        }
+      }
+    };
+
+    struct detached_entry
+    {
+      template<typename Task>
+      static void run(execution_context*, Task& task)
+      {
+        try
+        {
+          std::move(task)();
+        }
+        catch (boost::context::detail::forced_unwind const&)
+        {
+          throw;
+        }
+        catch (...)
+        {
+          detail::handle_detached_exception(std::current_exception());
+        }
+      }
+    };
+
     template<typename Task, typename Promise>
     void invoke(std::true_type /*void*/, Task&& task, Promise* promise)
     {
@@ -135,6 +937,12 @@ namespace awf {
     {
       promise->set_value(std::forward<Task>(task)());
     }
+    template<typename Task, typename T>
+    void invoke(std::false_type /*non void*/, Task&& task,
+                detail::future_state<T>* state)
+    {
+      state->emplace_result(std::forward<Task>(task));
+    }
   };
 
   template<typename T>
@@ -151,67 +959,1177 @@ namespace awf {
     auto get_future() { return promise_.get_future(); }
   };
 
-  using shared_execution_context = std::shared_ptr<execution_context>;
+  /// \brief Context which stores the result of its task in-place,
+  /// the result is read through a join_handle.
+  template<typename T>
+  class joinable_execution_context
+    : public execution_context
+  {
+    friend class execution_context;
+
+    // The state is embedded, so its references aren't used,
+    // the handle owns the context instead.
+    detail::future_state<T> result_;
+
+  public:
+    joinable_execution_context() { }
 
-  shared_execution_context& current_execution_context();
+    detail::future_state<T>& result() noexcept { return result_; }
+  };
 
+  /// \brief Move-only handle to the in-place result of a context
+  /// spawned through spawn(), the result is taken once through
+  /// get() or by awaiting the handle.
   template<typename T>
-  T _awaitify_impl_ (future_t<T>&& future_)
+  class join_handle
   {
-      assert(future_.valid() &&
-             "The given future_t is invalid!");
+    boost::intrusive_ptr<joinable_execution_context<T>> context_;
+
+  public:
+    join_handle() = default;
+    explicit join_handle(
+      boost::intrusive_ptr<joinable_execution_context<T>> context) noexcept
+      : context_(std::move(context)) { }
+    join_handle(join_handle const&) = delete;
+    join_handle(join_handle&&) = default;
+    join_handle& operator= (join_handle const&) = delete;
+    join_handle& operator= (join_handle&&) = default;
+
+    bool valid() const noexcept { return bool(context_); }
+
+    bool is_ready() const noexcept
+    {
+      assert(valid() && "The handle is invalid!");
+      return context_->result().is_ready();
+    }
 
-      // Return the future_t immediately if it's ready
-      if (future_.is_ready())
-        return future_.get();
+    /// Blocks until the context completed, moves its result out
+    /// or rethrows its exception, the handle is invalidated.
+    T get()
+    {
+      assert(valid() && "The handle is invalid!");
+      auto const context = std::move(context_);
+      context->result().wait();
+      return static_cast<T>(context->result().take());
+    }
 
-      // Suspend the context
-      auto f = future_.then(
-        [context = current_execution_context()](future_t<T> future)
+    /// Invokes the callback once on the thread which completes
+    /// the context, the result is taken through get() afterwards.
+    template<typename Callback>
+    void on_ready(Callback&& callback)
+    {
+      assert(valid() && "The handle is invalid!");
+      context_->result().set_continuation(
+        [callback = std::forward<Callback>(callback)]
+        (detail::future_state<T>*) mutable
       {
-        // Don't dispatch the continuation
-        // when the executor was stopped
-        if (!system_scheduler().stopped())
-          system_scheduler().post([context]
-          {
-            assert(context &&
-                   "Execution context is invalid!");
-            context->resume();
-          });
-        return future.get();
+        callback();
       });
-      assert(current_execution_context() &&
-             "Await isn't dispatched in a coroutine!" &&
-             "Use `asyncify` to create an awaitable context!");
-      current_execution_context()->suspend();
-      return f.get();
-  }
+    }
+  };
 
-  struct _awaiter_impl
-  {
-    template<typename T>
-    T operator<< (future_t<T>&& future) const
+  /// \brief Returns the context which is executed on the current thread
+  execution_context*& current_execution_context();
+
+  /// \brief Suspends the current context and enqueues its resumption
+  /// behind the pending work of its executor,
+  /// yields the thread when it's called outside of a context.
+  void yield();
+
+  namespace detail {
+    /// Returns the priority of the calling context, normal otherwise
+    inline priority current_priority()
     {
-      return _awaitify_impl_(std::move(future));
+      auto const context = current_execution_context();
+      return context ? context->get_priority() : priority::normal;
     }
-  };
+  } // namespace detail
 
-  template<typename T>
-  auto awaitify(T&& task)
-  {
-    using result_t = std::decay_t<decltype(std::forward<T>(task)())>;
+  namespace detail {
+    class timer_wheel;
 
-    auto context = std::make_shared<
-      specific_execution_context<result_t>>();
+    /// Link of the intrusive timer lists
+    struct timer_link
+    {
+      timer_link* prev = nullptr;
+      timer_link* next = nullptr;
+    };
 
-    auto future = context->get_future();
-    system_scheduler().post([c = std::move(context),
-                             t = std::forward<T>(task)] () mutable
+    /// \brief Intrusive node of a timer in the timer wheel
+    ///
+    /// The entry is owned by the caller and has to stay alive until
+    /// its callback was invoked or it was cancelled successfully.
+    /// The callback is invoked exactly once with expired set to true
+    /// on expiry, or with false when the wheel is torn down.
+    class timer_entry
+      : timer_link
     {
-      c->set_task<result_t>(std::forward<T>(t));
-      c->resume();
-    });
-    return future;
+      friend class timer_wheel;
+      friend void schedule_timer(timer_entry&,
+                                 std::chrono::steady_clock::time_point);
+
+      using callback_t = void(*)(void*, bool expired);
+
+      std::uint64_t expiry_;
+      callback_t callback_;
+      void* data_;
+
+    public:
+      timer_entry(callback_t callback, void* data) noexcept
+        : expiry_(0), callback_(callback), data_(data) { }
+      timer_entry(timer_entry const&) = delete;
+      timer_entry& operator= (timer_entry const&) = delete;
+    };
+
+    /// \brief Inserts the entry into the timer wheel in constant time,
+    /// the callback is invoked on the driver thread of the wheel
+    /// once the deadline expired.
+    void schedule_timer(timer_entry& entry,
+                        std::chrono::steady_clock::time_point deadline);
+
+    /// \brief Removes the entry from the timer wheel in constant time,
+    /// returns false when its callback was invoked or is about
+    /// to be invoked already.
+    bool cancel_timer(timer_entry& entry) noexcept;
+  } // namespace detail
+
+  namespace detail {
+    /// Invokes the callback with the completed future on the thread
+    /// which completes it, without launching threads or
+    /// creating intermediate futures where the future type allows it.
+    template<typename Future, typename Callback>
+    void when_ready(Future& future, Callback&& callback)
+    {
+      future.then(std::forward<Callback>(callback));
+    }
+    template<typename T, typename Callback>
+    void when_ready(awf::future<T>& future, Callback&& callback)
+    {
+      future.on_ready(std::forward<Callback>(callback));
+    }
+  #ifdef BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+    template<typename T, typename Callback>
+    void when_ready(boost::future<T>& future, Callback&& callback)
+    {
+      // The default launch policy of boost may run the continuation
+      // on a new thread, the synchronous one runs it on the
+      // completing thread. The chained future isn't used.
+      future.then(boost::launch::sync, std::forward<Callback>(callback));
+    }
+  #endif // BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+  } // namespace detail
+
+  /// \brief Customization point which makes a type awaitable
+  ///
+  /// A specialization provides:
+  /// - `static bool is_ready(T& awaitable)`
+  /// - `static void on_ready(T& awaitable, Callback&& callback)` which
+  ///   invokes the callback once on the thread which completes
+  ///   the awaitable, the awaitable is kept alive until then.
+  /// - `static auto get_result(T& awaitable)` which returns the result
+  ///   of the ready awaitable or throws its exception.
+  ///
+  /// The primary template supports futures which provide is_ready(),
+  /// get() and a continuation through then().
+  template<typename T, typename Enable = void>
+  struct awaitable_traits
+  {
+    static bool is_ready(T& future)
+    {
+      assert(future.valid() &&
+             "The given future_t is invalid!");
+      return future.is_ready();
+    }
+
+    template<typename Callback>
+    static void on_ready(T& future, Callback&& callback)
+    {
+      // The continuation hands the completed future back
+      detail::when_ready(future,
+        [slot = &future, callback = std::forward<Callback>(callback)]
+        (T ready) mutable
+      {
+        *slot = std::move(ready);
+        callback();
+      });
+    }
+
+    static decltype(auto) get_result(T& future)
+    {
+      return future.get();
+    }
+  };
+
+  template<typename T>
+  struct awaitable_traits<join_handle<T>>
+  {
+    static bool is_ready(join_handle<T>& handle)
+    {
+      return handle.is_ready();
+    }
+
+    template<typename Callback>
+    static void on_ready(join_handle<T>& handle, Callback&& callback)
+    {
+      handle.on_ready(std::forward<Callback>(callback));
+    }
+
+    static T get_result(join_handle<T>& handle)
+    {
+      return handle.get();
+    }
+  };
+
+#ifdef BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+  template<typename T>
+  struct awaitable_traits<boost::shared_future<T>>
+  {
+    static bool is_ready(boost::shared_future<T>& future)
+    {
+      assert(future.valid() &&
+             "The given future_t is invalid!");
+      return future.is_ready();
+    }
+
+    template<typename Callback>
+    static void on_ready(boost::shared_future<T>& future, Callback&& callback)
+    {
+      // The shared state stays valid, the chained future isn't used
+      future.then(boost::launch::sync,
+        [callback = std::forward<Callback>(callback)]
+        (boost::shared_future<T>) mutable
+      {
+        callback();
+      });
+    }
+
+    static auto get_result(boost::shared_future<T>& future)
+    {
+      return future.get();
+    }
+  };
+#endif // BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+
+  namespace detail {
+    /// Polls a future without continuation support on every tick
+    /// of the timer wheel, which bounds the latency of its
+    /// completion to the resolution of the wheel (1 ms).
+    template<typename Future, typename Callback>
+    class ready_poller
+    {
+      Future* future_;
+      Callback callback_;
+      timer_entry timer_;
+
+    public:
+      ready_poller(Future& future, Callback callback)
+        : future_(&future), callback_(std::move(callback)),
+          timer_(&ready_poller::on_timer, this) { }
+
+      static void* operator new (std::size_t size)
+      {
+        return allocate_recycled(size);
+      }
+      static void operator delete (void* block, std::size_t size) noexcept
+      {
+        deallocate_recycled(block, size);
+      }
+
+      void poll()
+      {
+        schedule_timer(timer_, std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(1));
+      }
+
+    private:
+      static void on_timer(void* data, bool expired)
+      {
+        std::unique_ptr<ready_poller> poller(static_cast<ready_poller*>(data));
+        if (!expired)
+          return;
+
+        if (poller->future_->wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready)
+        {
+          poller->callback_();
+          return;
+        }
+        poller.release()->poll();
+      }
+    };
+
+    /// Traits of the standard futures which don't support continuations
+    template<typename Future>
+    struct std_future_traits
+    {
+      static bool is_ready(Future& future)
+      {
+        assert(future.valid() &&
+               "The given future_t is invalid!");
+        return future.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready;
+      }
+
+      template<typename Callback>
+      static void on_ready(Future& future, Callback&& callback)
+      {
+        (new ready_poller<Future, std::decay_t<Callback>>(
+          future, std::forward<Callback>(callback)))->poll();
+      }
+
+      static auto get_result(Future& future)
+      {
+        return future.get();
+      }
+    };
+  } // namespace detail
+
+  template<typename T>
+  struct awaitable_traits<std::future<T>>
+    : detail::std_future_traits<std::future<T>> { };
+
+  template<typename T>
+  struct awaitable_traits<std::shared_future<T>>
+    : detail::std_future_traits<std::shared_future<T>> { };
+
+  template<typename Awaitable>
+  decltype(auto) _awaitify_impl_ (Awaitable&& awaitable)
+  {
+      using traits = awaitable_traits<std::decay_t<Awaitable>>;
+
+      // Return the result immediately if it's ready,
+      // unless the context has to give way to other work.
+      if (traits::is_ready(awaitable))
+      {
+        auto const context = current_execution_context();
+        if (context && context->consume_budget())
+          yield();
+        return traits::get_result(awaitable);
+      }
+
+      assert(current_execution_context() &&
+             "Await isn't dispatched in a coroutine!" &&
+             "Use `asyncify` to create an awaitable context!");
+
+      // The continuation is attached after the context was left,
+      // so it can't be resumed before it was suspended completely.
+      // The reference of the resumer is moved through the continuation.
+      auto on_suspend = [&](shared_execution_context context)
+      {
+        traits::on_ready(awaitable, [context = std::move(context)] () mutable
+        {
+          execution_context::schedule(std::move(context));
+        });
+      };
+      current_execution_context()->suspend(on_suspend);
+      return traits::get_result(awaitable);
+  }
+
+  struct _awaiter_impl
+  {
+    template<typename Awaitable>
+    decltype(auto) operator<< (Awaitable&& awaitable) const
+    {
+      return _awaitify_impl_(std::forward<Awaitable>(awaitable));
+    }
+  };
+
+  namespace detail {
+    /// Counts the pending futures of a single suspension down,
+    /// the last completion resumes the suspended context.
+    class countdown
+    {
+      std::atomic<std::size_t> pending_;
+      shared_execution_context context_;
+
+    public:
+      explicit countdown(std::size_t count)
+        : pending_(count) { }
+
+      void arm(shared_execution_context context)
+      {
+        context_ = std::move(context);
+      }
+
+      void count_down()
+      {
+        if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          execution_context::schedule(std::move(context_));
+      }
+    };
+
+    /// Counts down once the awaitable is ready
+    template<typename Awaitable>
+    void count_down_on_ready(countdown& counter, Awaitable& awaitable)
+    {
+      awaitable_traits<Awaitable>::on_ready(awaitable, [&counter]
+      {
+        counter.count_down();
+      });
+    }
+
+    template<typename Awaitable>
+    bool is_ready(Awaitable& awaitable)
+    {
+      return awaitable_traits<Awaitable>::is_ready(awaitable);
+    }
+
+    template<typename Awaitable>
+    using awaitable_result_t = decltype(awaitable_traits<Awaitable>::
+      get_result(std::declval<Awaitable&>()));
+
+    template<typename Awaitable>
+    unit take_result(std::true_type /*void*/, Awaitable& awaitable)
+    {
+      awaitable_traits<Awaitable>::get_result(awaitable);
+      return {};
+    }
+    template<typename Awaitable>
+    awaitable_result_t<Awaitable> take_result(std::false_type /*non void*/,
+                                              Awaitable& awaitable)
+    {
+      return awaitable_traits<Awaitable>::get_result(awaitable);
+    }
+
+    /// Returns the result of the ready awaitable, void results
+    /// are returned as unit.
+    template<typename Awaitable>
+    auto take_result(Awaitable& awaitable)
+    {
+      return take_result(
+        std::is_void<awaitable_result_t<Awaitable>>{}, awaitable);
+    }
+
+    template<typename Awaitables, std::size_t... I>
+    void suspend_until_all(Awaitables& awaitables, std::index_sequence<I...>)
+    {
+      bool const ready[] = { true, is_ready(std::get<I>(awaitables))... };
+      if (std::all_of(std::begin(ready), std::end(ready),
+                      [](bool is_ready) { return is_ready; }))
+        return;
+
+      assert(current_execution_context() &&
+             "Await isn't dispatched in a coroutine!" &&
+             "Use `asyncify` to create an awaitable context!");
+
+      // The suspension holds one count itself so the context isn't
+      // resumed before every continuation was attached.
+      countdown counter(sizeof...(I) + 1);
+      auto on_suspend = [&](shared_execution_context context)
+      {
+        counter.arm(std::move(context));
+        int const attached[] = { 0, (count_down_on_ready(counter,
+          std::get<I>(awaitables)), 0)... };
+        (void)attached;
+        counter.count_down();
+      };
+      current_execution_context()->suspend(on_suspend);
+    }
+
+    template<typename Awaitable>
+    void suspend_until_all(std::vector<Awaitable>& awaitables)
+    {
+      if (std::all_of(awaitables.begin(), awaitables.end(),
+                      [](Awaitable& awaitable) { return is_ready(awaitable); }))
+        return;
+
+      assert(current_execution_context() &&
+             "Await isn't dispatched in a coroutine!" &&
+             "Use `asyncify` to create an awaitable context!");
+
+      countdown counter(awaitables.size() + 1);
+      auto on_suspend = [&](shared_execution_context context)
+      {
+        counter.arm(std::move(context));
+        for (auto& awaitable : awaitables)
+          count_down_on_ready(counter, awaitable);
+        counter.count_down();
+      };
+      current_execution_context()->suspend(on_suspend);
+    }
+
+    template<typename Awaitables, std::size_t... I>
+    auto take_results(Awaitables& awaitables, std::index_sequence<I...>)
+    {
+      return std::make_tuple(take_result(std::get<I>(awaitables))...);
+    }
+  } // namespace detail
+
+  /// \brief Suspends the current context once until all given awaitables
+  /// are ready and returns their results as tuple.
+  template<typename... Awaitables>
+  auto await_all(Awaitables&&... awaitables)
+  {
+    std::tuple<std::decay_t<Awaitables>...> pending(
+      std::forward<Awaitables>(awaitables)...);
+    detail::suspend_until_all(pending,
+      std::index_sequence_for<Awaitables...>{});
+    return detail::take_results(pending,
+      std::index_sequence_for<Awaitables...>{});
+  }
+
+  /// \brief Suspends the current context once until all awaitables
+  /// of the range are ready and returns their results as vector.
+  template<typename Range>
+  auto await_all(Range&& awaitables)
+    -> std::vector<decltype(detail::take_result(*std::begin(awaitables)))>
+  {
+    using awaitable_type = std::decay_t<decltype(*std::begin(awaitables))>;
+
+    std::vector<awaitable_type> pending;
+    for (auto&& awaitable : awaitables)
+      pending.push_back(std::move(awaitable));
+    detail::suspend_until_all(pending);
+
+    std::vector<decltype(detail::take_result(*std::begin(awaitables)))>
+      results;
+    results.reserve(pending.size());
+    for (auto& awaitable : pending)
+      results.push_back(detail::take_result(awaitable));
+    return results;
+  }
+
+  /// \brief Cancellation signal which is shared between
+  /// the awaiting side and the producers of futures.
+  ///
+  /// Producers register hooks through on_cancel() or poll
+  /// is_cancelled() to stop their work early.
+  class cancellation
+  {
+    struct state
+    {
+      std::mutex mutex;
+      std::atomic<bool> cancelled{false};
+      std::vector<std::function<void()>> hooks;
+    };
+
+    std::shared_ptr<state> state_;
+
+  public:
+    cancellation() : state_(std::make_shared<state>()) { }
+
+    bool is_cancelled() const noexcept
+    {
+      return state_->cancelled.load(std::memory_order_acquire);
+    }
+
+    /// Registers a hook which is invoked once on cancellation,
+    /// the hook is invoked immediately when cancelled already.
+    template<typename Hook>
+    void on_cancel(Hook&& hook)
+    {
+      {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (!is_cancelled())
+        {
+          state_->hooks.emplace_back(std::forward<Hook>(hook));
+          return;
+        }
+      }
+      hook();
+    }
+
+    /// Cancels and invokes the registered hooks on the calling thread
+    void cancel()
+    {
+      std::vector<std::function<void()>> hooks;
+      {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (state_->cancelled.exchange(true, std::memory_order_acq_rel))
+          return;
+        hooks.swap(state_->hooks);
+      }
+      for (auto& hook : hooks)
+        hook();
+    }
+  };
+
+  /// \brief Result of await_any
+  template<typename T>
+  struct any_result
+  {
+    /// The index of the future which completed first
+    std::size_t index;
+    /// The result of the future which completed first
+    T value;
+  };
+
+  namespace detail {
+    /// State of an await_any which outlives the suspension
+    /// since the losing awaitables complete after the resumption.
+    template<typename Awaitable>
+    class any_state
+    {
+      std::atomic<std::size_t> references_;
+      std::atomic<bool> decided_;
+      // Opened by the first completion and after every
+      // continuation was attached.
+      std::atomic<int> gate_;
+      std::size_t index_;
+      std::vector<Awaitable> awaitables_;
+      shared_execution_context context_;
+      cancellation cancellation_;
+
+    public:
+      any_state(cancellation cancel, std::vector<Awaitable> awaitables)
+        : references_(0), decided_(false), gate_(2), index_(0),
+          awaitables_(std::move(awaitables)),
+          cancellation_(std::move(cancel)) { }
+
+      static void* operator new (std::size_t size)
+      {
+        return allocate_recycled(size);
+      }
+      static void operator delete (void* block, std::size_t size) noexcept
+      {
+        deallocate_recycled(block, size);
+      }
+
+      void arm(shared_execution_context context)
+      {
+        context_ = std::move(context);
+      }
+
+      void complete(std::size_t index)
+      {
+        // The results of the losers are dropped
+        if (decided_.exchange(true, std::memory_order_acq_rel))
+          return;
+
+        index_ = index;
+        cancellation_.cancel();
+        open();
+      }
+
+      void open()
+      {
+        if (gate_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          execution_context::schedule(std::move(context_));
+      }
+
+      std::vector<Awaitable>& awaitables() noexcept { return awaitables_; }
+      std::size_t index() const noexcept { return index_; }
+      Awaitable& winner() noexcept { return awaitables_[index_]; }
+
+      friend void intrusive_ptr_add_ref(any_state* state) noexcept
+      {
+        state->references_.fetch_add(1, std::memory_order_relaxed);
+      }
+      friend void intrusive_ptr_release(any_state* state) noexcept
+      {
+        if (state->references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          delete state;
+      }
+    };
+
+    template<typename Awaitable>
+    auto await_any_of(cancellation cancel, std::vector<Awaitable> awaitables)
+      -> any_result<decltype(take_result(std::declval<Awaitable&>()))>
+    {
+      using traits = awaitable_traits<Awaitable>;
+      assert(!awaitables.empty() && "Can't await any of no futures!");
+
+      // Return the first ready awaitable immediately
+      auto ready = std::find_if(awaitables.begin(), awaitables.end(),
+        [](Awaitable& awaitable) { return traits::is_ready(awaitable); });
+      if (ready != awaitables.end())
+      {
+        cancel.cancel();
+        return { std::size_t(ready - awaitables.begin()), take_result(*ready) };
+      }
+
+      assert(current_execution_context() &&
+             "Await isn't dispatched in a coroutine!" &&
+             "Use `asyncify` to create an awaitable context!");
+
+      // The state keeps the awaitables alive until the losers completed
+      boost::intrusive_ptr<any_state<Awaitable>> state(
+        new any_state<Awaitable>(std::move(cancel), std::move(awaitables)));
+      auto on_suspend = [&](shared_execution_context context)
+      {
+        state->arm(std::move(context));
+        auto& pending = state->awaitables();
+        for (std::size_t i = 0; i < pending.size(); ++i)
+          traits::on_ready(pending[i], [state, i]
+          {
+            state->complete(i);
+          });
+        state->open();
+      };
+      current_execution_context()->suspend(on_suspend);
+      return { state->index(), take_result(state->winner()) };
+    }
+
+    template<typename... Futures>
+    auto make_future_vector(Futures&&... futures)
+    {
+      std::vector<std::common_type_t<std::decay_t<Futures>...>> vector;
+      vector.reserve(sizeof...(Futures));
+      int const pushed[] = { 0,
+        (vector.push_back(std::forward<Futures>(futures)), 0)... };
+      (void)pushed;
+      return vector;
+    }
+
+    template<typename Range>
+    auto make_future_vector(Range&& futures)
+      -> std::vector<std::decay_t<decltype(*std::begin(futures))>>
+    {
+      std::vector<std::decay_t<decltype(*std::begin(futures))>> vector;
+      for (auto&& future : futures)
+        vector.push_back(std::move(future));
+      return vector;
+    }
+  } // namespace detail
+
+  /// \brief Suspends the current context until the first of the given
+  /// futures is ready and returns its index and result.
+  /// The cancellation is signaled to the producers of the remaining
+  /// futures, their results are dropped. The futures are awaited
+  /// through their awaitable_traits.
+  template<typename... Futures>
+  auto await_any(cancellation cancel, Futures&&... futures)
+  {
+    return detail::await_any_of(std::move(cancel),
+      detail::make_future_vector(std::forward<Futures>(futures)...));
+  }
+
+  /// \brief Suspends the current context until the first of the given
+  /// futures is ready and returns its index and result.
+  template<typename... Futures>
+  auto await_any(Futures&&... futures)
+  {
+    return await_any(cancellation{}, std::forward<Futures>(futures)...);
+  }
+
+  namespace detail {
+    /// State of an await_until which outlives the suspension
+    /// since the losing side completes after the resumption.
+    template<typename Awaitable>
+    class deadline_state
+    {
+      std::atomic<std::size_t> references_;
+      std::atomic<bool> decided_;
+      // Opened by the first completion and after the continuation
+      // and the timer were attached.
+      std::atomic<int> gate_;
+      bool expired_;
+      Awaitable awaitable_;
+      shared_execution_context context_;
+      timer_entry timer_;
+
+    public:
+      explicit deadline_state(Awaitable awaitable)
+        : references_(0), decided_(false), gate_(2), expired_(false),
+          awaitable_(std::move(awaitable)),
+          timer_(&deadline_state::on_timer, this) { }
+
+      static void* operator new (std::size_t size)
+      {
+        return allocate_recycled(size);
+      }
+      static void operator delete (void* block, std::size_t size) noexcept
+      {
+        deallocate_recycled(block, size);
+      }
+
+      void arm(shared_execution_context context,
+               std::chrono::steady_clock::time_point deadline)
+      {
+        context_ = std::move(context);
+        // The wheel holds a reference until the callback was invoked
+        intrusive_ptr_add_ref(this);
+        schedule_timer(timer_, deadline);
+      }
+
+      void complete()
+      {
+        if (!decided_.exchange(true, std::memory_order_acq_rel))
+          open();
+      }
+
+      void open()
+      {
+        if (gate_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+          return;
+
+        // The caller holds a reference, the state stays alive
+        if (!expired_ && cancel_timer(timer_))
+          intrusive_ptr_release(this);
+        execution_context::schedule(std::move(context_));
+      }
+
+      bool expired() const noexcept { return expired_; }
+      Awaitable& awaitable() noexcept { return awaitable_; }
+
+      friend void intrusive_ptr_add_ref(deadline_state* state) noexcept
+      {
+        state->references_.fetch_add(1, std::memory_order_relaxed);
+      }
+      friend void intrusive_ptr_release(deadline_state* state) noexcept
+      {
+        if (state->references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          delete state;
+      }
+
+    private:
+      static void on_timer(void* data, bool expired)
+      {
+        // Adopts the reference of the wheel
+        boost::intrusive_ptr<deadline_state> state(
+          static_cast<deadline_state*>(data), false);
+
+        if (expired && !state->decided_.exchange(true,
+                                                  std::memory_order_acq_rel))
+        {
+          state->expired_ = true;
+          state->open();
+        }
+      }
+    };
+  } // namespace detail
+
+  /// \brief Suspends the current context until the future is ready
+  /// or the deadline expired, returns an empty optional on expiry.
+  /// The deadline is tracked by the timer wheel, a late completing
+  /// future is dropped. The future is awaited through its awaitable_traits.
+  template<typename Awaitable>
+  auto await_until(std::chrono::steady_clock::time_point deadline,
+                   Awaitable&& awaitable)
+    -> boost::optional<decltype(detail::take_result(awaitable))>
+  {
+    using awaitable_type = std::decay_t<Awaitable>;
+    using traits = awaitable_traits<awaitable_type>;
+
+    awaitable_type pending(std::forward<Awaitable>(awaitable));
+    if (traits::is_ready(pending))
+      return detail::take_result(pending);
+    if (deadline <= std::chrono::steady_clock::now())
+      return boost::none;
+
+    assert(current_execution_context() &&
+           "Await isn't dispatched in a coroutine!" &&
+           "Use `asyncify` to create an awaitable context!");
+
+    // The state keeps the awaitable alive until it completed
+    boost::intrusive_ptr<detail::deadline_state<awaitable_type>> state(
+      new detail::deadline_state<awaitable_type>(std::move(pending)));
+    auto on_suspend = [&](shared_execution_context context)
+    {
+      state->arm(std::move(context), deadline);
+      traits::on_ready(state->awaitable(), [state]
+      {
+        state->complete();
+      });
+      state->open();
+    };
+    current_execution_context()->suspend(on_suspend);
+
+    if (state->expired())
+      return boost::none;
+    return detail::take_result(state->awaitable());
+  }
+
+  /// \brief Suspends the current context until the future is ready
+  /// or the duration elapsed, returns an empty optional on expiry.
+  template<typename Rep, typename Period, typename Future>
+  auto await_for(std::chrono::duration<Rep, Period> const& duration,
+                 Future&& future)
+  {
+    return await_until(std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration),
+      std::forward<Future>(future));
+  }
+
+  /// \brief Suspends the current context until the deadline expired
+  /// without blocking the thread of the scheduler.
+  void sleep_until(std::chrono::steady_clock::time_point deadline);
+
+  /// \brief Suspends the current context for the given duration
+  /// without blocking the thread of the scheduler.
+  template<typename Rep, typename Period>
+  void sleep_for(std::chrono::duration<Rep, Period> const& duration)
+  {
+    sleep_until(std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration));
+  }
+
+  namespace detail {
+    /// Posts the start of a context of the given priority class
+    template<typename Start>
+    void post_start(executor& scheduler, scheduler_queue& queue,
+                    priority level, Start&& start)
+    {
+      if (level == priority::normal)
+        scheduler.post([&queue, start = std::forward<Start>(start)]
+                       () mutable
+        {
+          detail::run_high_priority(queue);
+          start();
+        });
+      else
+        enqueue_prioritized(queue, level,
+          new executor_task_impl<std::decay_t<Start>>(
+            std::forward<Start>(start)));
+    }
+  } // namespace detail
+
+  /// \brief Spawns the task as context on the given shard,
+  /// the context is never resumed on another thread.
+  /// Shards run their contexts in FIFO order without priority classes.
+  template<typename T>
+  auto awaitify(shard& target, T&& task)
+  {
+    using result_t = std::decay_t<decltype(std::forward<T>(task)())>;
+
+    auto context = execution_context::create<
+      specific_execution_context<result_t>>(execution_context::admit());
+    context->bind(target);
+
+    context->template set_task<result_t>(std::forward<T>(task));
+    auto future = context->get_future();
+    target.post([c = std::move(context)] () mutable
+    {
+      execution_context::start(std::move(c));
+    });
+    return future;
+  }
+
+  /// \brief Spawns the task as context of the given priority class
+  /// on the given executor, the context is always resumed through
+  /// the executor.
+  template<typename T>
+  auto awaitify(executor& scheduler, priority level, T&& task)
+  {
+    using result_t = std::decay_t<decltype(std::forward<T>(task)())>;
+
+    auto context = execution_context::create<
+      specific_execution_context<result_t>>(execution_context::admit());
+    context->bind(scheduler);
+    context->set_priority(level);
+
+    context->template set_task<result_t>(std::forward<T>(task));
+    auto future = context->get_future();
+    auto& queue = context->queue();
+    detail::post_start(scheduler, queue, level,
+                       [c = std::move(context)] () mutable
+    {
+      execution_context::start(std::move(c));
+    });
+    return future;
+  }
+
+  /// \brief Spawns the task as context on the given executor,
+  /// it inherits the priority of the calling context.
+  template<typename T>
+  auto awaitify(executor& scheduler, T&& task)
+  {
+    return awaitify(scheduler, detail::current_priority(),
+                    std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context of the given priority class
+  /// on the shard or executor of the calling context,
+  /// the system scheduler otherwise.
+  /// Shards run their contexts in FIFO order and don't support
+  /// priority classes, the priority has to be normal on a shard.
+  template<typename T>
+  auto awaitify(priority level, T&& task)
+  {
+    // Tasks spawned from a shard stay on it
+    if (auto const owner = current_shard())
+    {
+      assert((level == priority::normal) &&
+             "Shards run their contexts in FIFO order, "
+             "spawn the task on an executor to prioritize it!");
+      return awaitify(*owner, std::forward<T>(task));
+    }
+  #ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
+    if (!current_execution_context())
+      return awaitify(system_scheduler(), level, std::forward<T>(task));
+  #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
+
+    assert(current_execution_context() &&
+           "Spawn the task through awaitify(executor&, task)!");
+    return awaitify(current_execution_context()->scheduler(), level,
+                    std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context on the shard or executor
+  /// of the calling context, the system scheduler otherwise.
+  /// The context inherits the priority of the calling context.
+  template<typename T>
+  auto awaitify(T&& task)
+  {
+    return awaitify(detail::current_priority(), std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context on the given shard,
+  /// its result is stored in-place in the context.
+  template<typename T>
+  auto spawn(shard& target, T&& task)
+  {
+    using result_t = std::decay_t<decltype(std::forward<T>(task)())>;
+
+    auto context = execution_context::create<
+      joinable_execution_context<result_t>>(execution_context::admit());
+    context->bind(target);
+
+    context->template set_joinable_task<result_t>(std::forward<T>(task));
+    join_handle<result_t> handle(context);
+    target.post([c = std::move(context)] () mutable
+    {
+      execution_context::start(std::move(c));
+    });
+    return handle;
+  }
+
+  /// \brief Spawns the task as context of the given priority class
+  /// on the given executor, its result is stored in-place in the context
+  /// and read through the returned join_handle.
+  template<typename T>
+  auto spawn(executor& scheduler, priority level, T&& task)
+  {
+    using result_t = std::decay_t<decltype(std::forward<T>(task)())>;
+
+    auto context = execution_context::create<
+      joinable_execution_context<result_t>>(execution_context::admit());
+    context->bind(scheduler);
+    context->set_priority(level);
+
+    context->template set_joinable_task<result_t>(std::forward<T>(task));
+    join_handle<result_t> handle(context);
+    auto& queue = context->queue();
+    detail::post_start(scheduler, queue, level,
+                       [c = std::move(context)] () mutable
+    {
+      execution_context::start(std::move(c));
+    });
+    return handle;
+  }
+
+  /// \brief Spawns the task as context on the given executor,
+  /// it inherits the priority of the calling context.
+  template<typename T>
+  auto spawn(executor& scheduler, T&& task)
+  {
+    return spawn(scheduler, detail::current_priority(),
+                 std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context of the given priority class
+  /// on the shard or executor of the calling context,
+  /// the system scheduler otherwise.
+  /// The priority has to be normal on a shard.
+  template<typename T>
+  auto spawn(priority level, T&& task)
+  {
+    if (auto const owner = current_shard())
+    {
+      assert((level == priority::normal) &&
+             "Shards run their contexts in FIFO order, "
+             "spawn the task on an executor to prioritize it!");
+      return spawn(*owner, std::forward<T>(task));
+    }
+  #ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
+    if (!current_execution_context())
+      return spawn(system_scheduler(), level, std::forward<T>(task));
+  #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
+
+    assert(current_execution_context() &&
+           "Spawn the task through spawn(executor&, task)!");
+    return spawn(current_execution_context()->scheduler(), level,
+                 std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context on the shard or executor
+  /// of the calling context, the system scheduler otherwise.
+  /// Unlike awaitify() the result is stored in-place in the context
+  /// instead of a shared state, which supports move-only results.
+  template<typename T>
+  auto spawn(T&& task)
+  {
+    return spawn(detail::current_priority(), std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context on the given shard without
+  /// a future, its result is discarded.
+  template<typename T>
+  void spawn_detached(shard& target, T&& task)
+  {
+    auto context = execution_context::create<execution_context>(
+      execution_context::admit());
+    context->bind(target);
+
+    context->set_detached_task(std::forward<T>(task));
+    target.post([c = std::move(context)] () mutable
+    {
+      execution_context::start(std::move(c));
+    });
+  }
+
+  /// \brief Spawns the task as context of the given priority class
+  /// on the given executor without a future, its result is discarded.
+  template<typename T>
+  void spawn_detached(executor& scheduler, priority level, T&& task)
+  {
+    auto context = execution_context::create<execution_context>(
+      execution_context::admit());
+    context->bind(scheduler);
+    context->set_priority(level);
+
+    context->set_detached_task(std::forward<T>(task));
+    auto& queue = context->queue();
+    detail::post_start(scheduler, queue, level,
+                       [c = std::move(context)] () mutable
+    {
+      execution_context::start(std::move(c));
+    });
+  }
+
+  /// \brief Spawns the task as context on the given executor
+  /// without a future, it inherits the priority of the calling context.
+  template<typename T>
+  void spawn_detached(executor& scheduler, T&& task)
+  {
+    spawn_detached(scheduler, detail::current_priority(),
+                   std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context of the given priority class
+  /// without a future on the shard or executor of the calling context,
+  /// the system scheduler otherwise.
+  /// The priority has to be normal on a shard.
+  template<typename T>
+  void spawn_detached(priority level, T&& task)
+  {
+    if (auto const owner = current_shard())
+    {
+      assert((level == priority::normal) &&
+             "Shards run their contexts in FIFO order, "
+             "spawn the task on an executor to prioritize it!");
+      return spawn_detached(*owner, std::forward<T>(task));
+    }
+  #ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
+    if (!current_execution_context())
+      return spawn_detached(system_scheduler(), level, std::forward<T>(task));
+  #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
+
+    assert(current_execution_context() &&
+           "Spawn the task through spawn_detached(executor&, task)!");
+    spawn_detached(current_execution_context()->scheduler(), level,
+                   std::forward<T>(task));
+  }
+
+  /// \brief Spawns the task as context without a future
+  /// on the shard or executor of the calling context,
+  /// the system scheduler otherwise.
+  /// Exceptions which escape the task are passed to the handler
+  /// configured through configure_detached().
+  template<typename T>
+  void spawn_detached(T&& task)
+  {
+    spawn_detached(detail::current_priority(), std::forward<T>(task));
   }
 } // namespace awf
 
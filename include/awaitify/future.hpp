@@ -0,0 +1,466 @@
+//  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
+//     Distributed under the Boost Software License, Version 1.0
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef INCLUDED_AWAITIFY_FUTURE_HPP
+#define INCLUDED_AWAITIFY_FUTURE_HPP
+
+#include <new>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <exception>
+#include <type_traits>
+#include <condition_variable>
+#include <future>
+
+namespace awf {
+  namespace detail {
+    /// \brief Allocates a block from the free-lists of the calling thread
+    void* allocate_recycled(std::size_t size);
+
+    /// \brief Returns a block to the free-lists of the thread
+    /// which allocated it, blocks released by a different thread
+    /// are handed back to their owner without locking.
+    void deallocate_recycled(void* block, std::size_t size) noexcept;
+
+    /// \brief Standard allocator on top of the recycled free-lists
+    template<typename T>
+    class recycled_allocator
+    {
+    public:
+      using value_type = T;
+
+      recycled_allocator() noexcept = default;
+      template<typename U>
+      recycled_allocator(recycled_allocator<U> const&) noexcept { }
+
+      T* allocate(std::size_t count)
+      {
+        return static_cast<T*>(allocate_recycled(count * sizeof(T)));
+      }
+      void deallocate(T* block, std::size_t count) noexcept
+      {
+        deallocate_recycled(block, count * sizeof(T));
+      }
+
+      template<typename U>
+      bool operator== (recycled_allocator<U> const&) const noexcept
+      {
+        return true;
+      }
+      template<typename U>
+      bool operator!= (recycled_allocator<U> const&) const noexcept
+      {
+        return false;
+      }
+    };
+  } // namespace detail
+
+  /// \brief Value which represents the result of a void future
+  struct unit { };
+
+  template<typename T>
+  class future;
+  template<typename T>
+  class promise;
+
+  namespace detail {
+    template<typename T>
+    using future_value_t =
+      std::conditional_t<std::is_void<T>::value, unit, T>;
+
+    /// \brief Shared state of a future and promise pair
+    ///
+    /// The state supports exactly one continuation which is attached
+    /// through a single atomic state word, the value is stored in-place.
+    /// Whichever side comes second, the one which sets the value or
+    /// the one which attaches the continuation, invokes the continuation.
+    template<typename T>
+    class future_state
+    {
+      using value_t = future_value_t<T>;
+      using invoker_t = void(*)(void*, future_state*);
+
+      enum : unsigned
+      {
+        state_ready = 1,
+        state_continuation = 2
+      };
+
+      static std::size_t const continuation_capacity = 4 * sizeof(void*);
+
+      std::atomic<unsigned> references_;
+      std::atomic<unsigned> state_;
+      bool has_value_;
+      std::exception_ptr exception_;
+      std::aligned_storage_t<sizeof(value_t), alignof(value_t)> value_;
+      invoker_t invoker_;
+      std::aligned_storage_t<continuation_capacity,
+                             alignof(std::max_align_t)> continuation_;
+
+    public:
+      future_state()
+        : references_(1), state_(0), has_value_(false), invoker_(nullptr) { }
+      ~future_state()
+      {
+        if (has_value_)
+          reinterpret_cast<value_t*>(&value_)->~value_t();
+      }
+      future_state(future_state const&) = delete;
+      future_state& operator= (future_state const&) = delete;
+
+      static void* operator new (std::size_t size)
+      {
+        return allocate_recycled(size);
+      }
+      static void operator delete (void* block, std::size_t size) noexcept
+      {
+        deallocate_recycled(block, size);
+      }
+
+      void add_reference() noexcept
+      {
+        references_.fetch_add(1, std::memory_order_relaxed);
+      }
+      void release() noexcept
+      {
+        if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          delete this;
+      }
+
+      bool is_ready() const noexcept
+      {
+        return (state_.load(std::memory_order_acquire) & state_ready) != 0;
+      }
+
+      template<typename... Args>
+      void set_value(Args&&... args)
+      {
+        new (&value_) value_t(std::forward<Args>(args)...);
+        has_value_ = true;
+        publish();
+      }
+      /// Constructs the value in-place from the result of the callable,
+      /// which elides the move of the returned value.
+      template<typename Callable>
+      void emplace_result(Callable&& callable)
+      {
+        new (&value_) value_t(std::forward<Callable>(callable)());
+        has_value_ = true;
+        publish();
+      }
+      void set_exception(std::exception_ptr exception)
+      {
+        exception_ = std::move(exception);
+        publish();
+      }
+
+      /// Attaches the continuation which is invoked once with
+      /// the state when it becomes ready.
+      template<typename Callable>
+      void set_continuation(Callable&& callable)
+      {
+        assert(!invoker_ && "The continuation was attached already!");
+        emplace_continuation(std::forward<Callable>(callable),
+          std::integral_constant<bool,
+            (sizeof(std::decay_t<Callable>) <= continuation_capacity) &&
+            (alignof(std::decay_t<Callable>) <= alignof(std::max_align_t))>{});
+
+        if (state_.fetch_or(state_continuation, std::memory_order_acq_rel)
+            & state_ready)
+          invoker_(&continuation_, this);
+      }
+
+      /// Blocks until the state is ready
+      void wait()
+      {
+        if (is_ready())
+          return;
+
+        struct waiter
+        {
+          std::mutex mutex;
+          std::condition_variable condition;
+          bool ready = false;
+        } waiter;
+
+        set_continuation([&waiter](future_state*)
+        {
+          std::lock_guard<std::mutex> lock(waiter.mutex);
+          waiter.ready = true;
+          waiter.condition.notify_one();
+        });
+
+        std::unique_lock<std::mutex> lock(waiter.mutex);
+        waiter.condition.wait(lock, [&] { return waiter.ready; });
+      }
+
+      /// Moves the value out of the ready state or rethrows its exception
+      value_t take()
+      {
+        assert(is_ready() && "The state isn't ready!");
+        if (exception_)
+          std::rethrow_exception(exception_);
+        return std::move(*reinterpret_cast<value_t*>(&value_));
+      }
+
+    private:
+      void publish()
+      {
+        if (state_.fetch_or(state_ready, std::memory_order_acq_rel)
+            & state_continuation)
+          invoker_(&continuation_, this);
+      }
+
+      template<typename Callable>
+      void emplace_continuation(Callable&& callable, std::true_type /*inline*/)
+      {
+        using callable_t = std::decay_t<Callable>;
+        new (&continuation_) callable_t(std::forward<Callable>(callable));
+        invoker_ = [](void* storage, future_state* state)
+        {
+          auto& stored = *static_cast<callable_t*>(storage);
+          auto callable = std::move(stored);
+          stored.~callable_t();
+          callable(state);
+        };
+      }
+      template<typename Callable>
+      void emplace_continuation(Callable&& callable, std::false_type /*boxed*/)
+      {
+        using callable_t = std::decay_t<Callable>;
+        *reinterpret_cast<callable_t**>(&continuation_) =
+          new callable_t(std::forward<Callable>(callable));
+        invoker_ = [](void* storage, future_state* state)
+        {
+          std::unique_ptr<callable_t> callable(
+            *static_cast<callable_t**>(storage));
+          (*callable)(state);
+        };
+      }
+    };
+
+    template<typename Promise, typename Callable, typename Argument>
+    void fulfill(std::true_type /*void*/, Promise& promise,
+                 Callable& callable, Argument&& argument)
+    {
+      callable(std::forward<Argument>(argument));
+      promise.set_value();
+    }
+    template<typename Promise, typename Callable, typename Argument>
+    void fulfill(std::false_type /*non void*/, Promise& promise,
+                 Callable& callable, Argument&& argument)
+    {
+      promise.set_value(callable(std::forward<Argument>(argument)));
+    }
+
+    /// Completes the promise with the result of the callable
+    template<typename T, typename Callable, typename Argument>
+    void fulfill(promise<T>& promise, Callable& callable, Argument&& argument)
+    {
+      try
+      {
+        fulfill(std::is_void<T>{}, promise, callable,
+                std::forward<Argument>(argument));
+      }
+      catch (...)
+      {
+        promise.set_exception(std::current_exception());
+      }
+    }
+  } // namespace detail
+
+  /// \brief Lightweight future optimized for a single continuation
+  ///
+  /// Unlike boost::future the shared state isn't protected by a mutex
+  /// and continuations are invoked on the thread which completes the
+  /// future, no helper threads are launched.
+  /// The interface matches the subset of boost::future used by awaitify.
+  template<typename T>
+  class future
+  {
+    template<typename>
+    friend class promise;
+    template<typename>
+    friend class future;
+    template<typename>
+    friend class detail::future_state;
+
+    detail::future_state<T>* state_;
+
+    /// Adopts the reference of the given state
+    explicit future(detail::future_state<T>* state) noexcept
+      : state_(state) { }
+
+  public:
+    future() noexcept : state_(nullptr) { }
+    ~future()
+    {
+      if (state_)
+        state_->release();
+    }
+    future(future const&) = delete;
+    future(future&& right) noexcept
+      : state_(std::exchange(right.state_, nullptr)) { }
+    future& operator= (future const&) = delete;
+    future& operator= (future&& right) noexcept
+    {
+      if (this != &right)
+      {
+        if (state_)
+          state_->release();
+        state_ = std::exchange(right.state_, nullptr);
+      }
+      return *this;
+    }
+
+    bool valid() const noexcept { return state_ != nullptr; }
+
+    bool is_ready() const noexcept
+    {
+      return state_ && state_->is_ready();
+    }
+
+    void wait() const
+    {
+      assert(valid() && "The future is invalid!");
+      state_->wait();
+    }
+
+    /// Returns the value of the future and invalidates it
+    T get()
+    {
+      assert(valid() && "The future is invalid!");
+      future holder(std::move(*this));
+      holder.state_->wait();
+      return static_cast<T>(holder.state_->take());
+    }
+
+    /// Invokes the callable with the ready future on the thread
+    /// which completes it, the future is invalidated.
+    /// Unlike then() no chained future is created and small callables
+    /// are stored inside the shared state without allocating.
+    template<typename Callable>
+    void on_ready(Callable&& callable)
+    {
+      assert(valid() && "The future is invalid!");
+      std::exchange(state_, nullptr)->set_continuation(
+        [callable = std::forward<Callable>(callable)]
+        (detail::future_state<T>* state) mutable
+      {
+        callable(future(state));
+      });
+    }
+
+    /// Invokes the callable with the ready future on the thread
+    /// which completes it, the future is invalidated.
+    template<typename Callable>
+    auto then(Callable&& callable)
+      -> future<decltype(std::declval<Callable&>()(std::declval<future>()))>
+    {
+      using result_t =
+        decltype(std::declval<Callable&>()(std::declval<future>()));
+
+      promise<result_t> chained;
+      auto result = chained.get_future();
+      on_ready([chained = std::move(chained),
+                callable = std::forward<Callable>(callable)]
+               (future ready) mutable
+      {
+        detail::fulfill(chained, callable, std::move(ready));
+      });
+      return result;
+    }
+  };
+
+  /// \brief Promise which completes a awf::future
+  template<typename T>
+  class promise
+  {
+    detail::future_state<T>* state_;
+    bool retrieved_;
+    bool satisfied_;
+
+  public:
+    promise()
+      : state_(new detail::future_state<T>()),
+        retrieved_(false), satisfied_(false) { }
+    ~promise()
+    {
+      if (!state_)
+        return;
+
+      if (retrieved_ && !satisfied_)
+        state_->set_exception(std::make_exception_ptr(
+          std::future_error(std::future_errc::broken_promise)));
+      state_->release();
+    }
+    promise(promise const&) = delete;
+    promise(promise&& right) noexcept
+      : state_(std::exchange(right.state_, nullptr)),
+        retrieved_(right.retrieved_), satisfied_(right.satisfied_) { }
+    promise& operator= (promise const&) = delete;
+    promise& operator= (promise&& right) noexcept
+    {
+      promise(std::move(right)).swap(*this);
+      return *this;
+    }
+
+    void swap(promise& right) noexcept
+    {
+      std::swap(state_, right.state_);
+      std::swap(retrieved_, right.retrieved_);
+      std::swap(satisfied_, right.satisfied_);
+    }
+
+    future<T> get_future()
+    {
+      assert(state_ && !retrieved_ &&
+             "The future was retrieved already!");
+      retrieved_ = true;
+      state_->add_reference();
+      return future<T>(state_);
+    }
+
+    template<typename... Args>
+    void set_value(Args&&... args)
+    {
+      assert(state_ && !satisfied_ &&
+             "The promise was satisfied already!");
+      satisfied_ = true;
+      state_->set_value(std::forward<Args>(args)...);
+    }
+
+    void set_exception(std::exception_ptr exception)
+    {
+      assert(state_ && !satisfied_ &&
+             "The promise was satisfied already!");
+      satisfied_ = true;
+      state_->set_exception(std::move(exception));
+    }
+  };
+
+  /// \brief Returns a ready awf::future holding the given value
+  template<typename T>
+  future<std::decay_t<T>> make_ready_future(T&& value)
+  {
+    promise<std::decay_t<T>> promise;
+    promise.set_value(std::forward<T>(value));
+    return promise.get_future();
+  }
+
+  /// \brief Returns a ready awf::future<void>
+  inline future<void> make_ready_future()
+  {
+    promise<void> promise;
+    promise.set_value();
+    return promise.get_future();
+  }
+} // namespace awf
+
+#endif // INCLUDED_AWAITIFY_FUTURE_HPP
@@ -0,0 +1,234 @@
+//  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
+//     Distributed under the Boost Software License, Version 1.0
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef INCLUDED_AWAITIFY_USE_AWAIT_HPP
+#define INCLUDED_AWAITIFY_USE_AWAIT_HPP
+
+#include <tuple>
+#include <cassert>
+#include <utility>
+#include <exception>
+#include <type_traits>
+#include <boost/optional.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/basic_waitable_timer.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "awaitify/awaitify.hpp"
+
+namespace awf {
+  /// \brief Completion token which suspends the current context
+  /// until the asio operation completed:
+  /// `auto size = socket.async_read_some(buffer, awf::use_await);`
+  ///
+  /// The result is stored on the stack of the context which is resumed
+  /// directly by the completion handler when it's invoked on a thread
+  /// of the shard or executor of the context, otherwise the resumption
+  /// is scheduled there. The handler is allocated from
+  /// the recycled free-lists. A leading error code is thrown
+  /// as boost::system::system_error.
+  /// Asio timers are awaitable through `await timer` as well.
+  struct use_await_t { };
+
+  /// \brief Instance of the use_await_t completion token
+  constexpr use_await_t use_await{};
+
+  namespace detail {
+    template<std::size_t Offset, std::size_t... I>
+    std::index_sequence<(Offset + I)...>
+    offset_sequence(std::index_sequence<I...>) { return { }; }
+
+    /// Moves the values out of the tuple, a single value is returned
+    /// as it is, no value as void and more values as tuple.
+    template<typename... T>
+    struct packed_result
+    {
+      using type = std::tuple<T...>;
+
+      template<typename Tuple, std::size_t... I>
+      static type take(Tuple& values, std::index_sequence<I...>)
+      {
+        return type(std::move(std::get<I>(values))...);
+      }
+    };
+    template<typename T>
+    struct packed_result<T>
+    {
+      using type = T;
+
+      template<typename Tuple, std::size_t I>
+      static type take(Tuple& values, std::index_sequence<I>)
+      {
+        return std::move(std::get<I>(values));
+      }
+    };
+    template<>
+    struct packed_result<>
+    {
+      using type = void;
+
+      template<typename Tuple>
+      static void take(Tuple&, std::index_sequence<>) { }
+    };
+
+    /// Converts the arguments of a completion handler into the result
+    template<typename... Args>
+    struct await_completion
+    {
+      using result_type = typename packed_result<Args...>::type;
+
+      static result_type take(std::tuple<Args...>& values)
+      {
+        return packed_result<Args...>::take(
+          values, std::index_sequence_for<Args...>{});
+      }
+    };
+    template<typename... Args>
+    struct await_completion<boost::system::error_code, Args...>
+    {
+      using result_type = typename packed_result<Args...>::type;
+
+      static result_type take(
+        std::tuple<boost::system::error_code, Args...>& values)
+      {
+        if (auto const& error = std::get<0>(values))
+          throw boost::system::system_error(error);
+
+        return packed_result<Args...>::take(
+          values, offset_sequence<1>(std::index_sequence_for<Args...>{}));
+      }
+    };
+
+    /// Completion handler which stores its arguments on the stack
+    /// of the suspended context and resumes it in place
+    /// when it's invoked on a thread of the context.
+    template<typename... Args>
+    class await_handler
+    {
+      using slot_t = boost::optional<std::tuple<Args...>>;
+
+      slot_t* slot_;
+      shared_execution_context context_;
+
+    public:
+      using allocator_type = recycled_allocator<void>;
+
+      await_handler(slot_t* slot, shared_execution_context context)
+        : slot_(slot), context_(std::move(context)) { }
+
+      allocator_type get_allocator() const noexcept { return { }; }
+
+      template<typename... Values>
+      void operator() (Values&&... values)
+      {
+        slot_->emplace(std::forward<Values>(values)...);
+        execution_context::resume_or_schedule(std::move(context_));
+      }
+    };
+
+    template<typename... Args, typename Initiation, typename... InitArgs>
+    auto await_initiate(Initiation&& initiation, InitArgs&&... args)
+      -> typename await_completion<Args...>::result_type
+    {
+      assert(current_execution_context() &&
+             "Await isn't dispatched in a coroutine!" &&
+             "Use `asyncify` to create an awaitable context!");
+
+      boost::optional<std::tuple<Args...>> values;
+      std::exception_ptr exception;
+
+      // The operation is initiated after the context was suspended,
+      // so the handler can't observe a running context.
+      auto on_suspend = [&](shared_execution_context context)
+      {
+        try
+        {
+          std::forward<Initiation>(initiation)(
+            await_handler<Args...>(&values, context),
+            std::forward<InitArgs>(args)...);
+        }
+        catch (...)
+        {
+          exception = std::current_exception();
+          execution_context::schedule(std::move(context));
+        }
+      };
+      current_execution_context()->suspend(on_suspend);
+
+      if (exception)
+        std::rethrow_exception(exception);
+      return await_completion<Args...>::take(*values);
+    }
+
+    /// Completion handler which invokes the ready callback of an awaitable
+    template<typename Callback>
+    class ready_handler
+    {
+      Callback callback_;
+
+    public:
+      using allocator_type = recycled_allocator<void>;
+
+      explicit ready_handler(Callback callback)
+        : callback_(std::move(callback)) { }
+
+      allocator_type get_allocator() const noexcept { return { }; }
+
+      void operator() (boost::system::error_code const&)
+      {
+        callback_();
+      }
+    };
+  } // namespace detail
+
+  /// \brief Awaiting an asio timer suspends the current context until
+  /// the timer expired, cancelling the timer resumes the context early.
+  template<typename Clock, typename WaitTraits, typename Executor>
+  struct awaitable_traits<
+    boost::asio::basic_waitable_timer<Clock, WaitTraits, Executor>>
+  {
+    using timer_t =
+      boost::asio::basic_waitable_timer<Clock, WaitTraits, Executor>;
+
+    static bool is_ready(timer_t& timer)
+    {
+      return Clock::now() >= timer.expiry();
+    }
+
+    template<typename Callback>
+    static void on_ready(timer_t& timer, Callback&& callback)
+    {
+      timer.async_wait(detail::ready_handler<std::decay_t<Callback>>(
+        std::forward<Callback>(callback)));
+    }
+
+    static void get_result(timer_t&) { }
+  };
+} // namespace awf
+
+namespace boost {
+namespace asio {
+  template<typename Result, typename... Args>
+  class async_result<awf::use_await_t, Result(Args...)>
+  {
+    using completion_t = awf::detail::await_completion<std::decay_t<Args>...>;
+
+  public:
+    using return_type = typename completion_t::result_type;
+
+    template<typename Initiation, typename... InitArgs>
+    static return_type initiate(Initiation&& initiation,
+                                awf::use_await_t, InitArgs&&... args)
+    {
+      return awf::detail::await_initiate<std::decay_t<Args>...>(
+        std::forward<Initiation>(initiation),
+        std::forward<InitArgs>(args)...);
+    }
+  };
+} // namespace asio
+} // namespace boost
+
+#endif // INCLUDED_AWAITIFY_USE_AWAIT_HPP
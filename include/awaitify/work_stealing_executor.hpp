@@ -0,0 +1,233 @@
+//  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
+//     Distributed under the Boost Software License, Version 1.0
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef INCLUDED_AWAITIFY_WORK_STEALING_EXECUTOR_HPP
+#define INCLUDED_AWAITIFY_WORK_STEALING_EXECUTOR_HPP
+
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+#include <condition_variable>
+
+#include "awaitify/future.hpp"
+
+namespace awf {
+  namespace detail {
+    /// \brief Intrusive node of a task posted to the work-stealing executor
+    class executor_task
+    {
+      using invoker_t = void(*)(executor_task*, bool run);
+
+      invoker_t invoker_;
+
+    public:
+      /// The next task of the injection queue
+      executor_task* next;
+
+      explicit executor_task(invoker_t invoker) noexcept
+        : invoker_(invoker), next(nullptr) { }
+
+      /// Invokes and releases the task
+      void run() { invoker_(this, true); }
+      /// Releases the task without invoking it
+      void destroy() noexcept { invoker_(this, false); }
+    };
+
+    template<typename Function>
+    class executor_task_impl
+      : public executor_task
+    {
+      Function function_;
+
+    public:
+      template<typename F>
+      explicit executor_task_impl(F&& function)
+        : executor_task(&executor_task_impl::invoke),
+          function_(std::forward<F>(function)) { }
+
+      static void* operator new (std::size_t size)
+      {
+        return allocate_recycled(size);
+      }
+      static void operator delete (void* block, std::size_t size) noexcept
+      {
+        deallocate_recycled(block, size);
+      }
+
+    private:
+      static void invoke(executor_task* task, bool run)
+      {
+        std::unique_ptr<executor_task_impl> self(
+          static_cast<executor_task_impl*>(task));
+        if (run)
+          self->function_();
+      }
+    };
+  } // namespace detail
+
+  /// \brief Executor which distributes tasks over a work-stealing deque
+  /// per thread, usable through AWAITIFY_PROVIDE_EXECUTOR_TYPE.
+  ///
+  /// Tasks posted from a thread of the executor are pushed onto the
+  /// Chase-Lev deque of the thread and taken back in LIFO order,
+  /// tasks posted from other threads go through a global injection queue.
+  /// Idle threads steal from the deques of randomly chosen threads.
+  ///
+  /// Tasks posted to a specific worker through post_to() are queued in
+  /// the mailbox of the worker, other threads only take them over while
+  /// the worker is parked, its mailbox holds a backlog or wasn't served
+  /// for the starvation threshold of the executor.
+  /// The interface matches the subset of boost::asio::io_service
+  /// used by awaitify and its tests.
+  class work_stealing_executor
+  {
+    struct worker;
+
+    std::size_t const capacity_;
+    /// Mailboxes which weren't served by their worker for this duration
+    /// while other threads were parked are taken over.
+    std::chrono::steady_clock::duration const starvation_;
+    std::unique_ptr<worker[]> workers_;
+    /// The count of worker slots which were claimed at least once
+    std::atomic<std::size_t> registered_;
+    /// The count of pending tasks and work guards
+    std::atomic<std::size_t> outstanding_;
+    std::atomic<bool> stopped_;
+
+    std::mutex injection_mutex_;
+    detail::executor_task* injection_head_;
+    detail::executor_task* injection_tail_;
+    std::atomic<std::size_t> injected_;
+
+    std::mutex mutex_;
+    std::atomic<std::size_t> sleeping_;
+
+  public:
+    /// Returned by current_worker() on threads which don't run the executor
+    static constexpr std::size_t no_worker = std::size_t(-1);
+
+    /// Tasks of a mailbox are stolen when more than this count is queued
+    static constexpr std::size_t mailbox_backlog = 2;
+
+    /// \brief Keeps run() from returning while no tasks are pending
+    class work
+    {
+      work_stealing_executor* executor_;
+
+    public:
+      explicit work(work_stealing_executor& executor) noexcept
+        : executor_(&executor)
+      {
+        executor_->outstanding_.fetch_add(1, std::memory_order_relaxed);
+      }
+      work(work const& right) noexcept
+        : work(*right.executor_) { }
+      work& operator= (work const&) = delete;
+      ~work()
+      {
+        executor_->finish();
+      }
+    };
+
+    /// Creates the executor which is run by up to max_threads threads,
+    /// 0 selects the hardware concurrency but at least 64 threads.
+    /// The mailboxes of workers are taken over by parked threads
+    /// after they weren't served for the starvation duration.
+    explicit work_stealing_executor(std::size_t max_threads = 0,
+      std::chrono::steady_clock::duration starvation =
+        std::chrono::milliseconds(1));
+    ~work_stealing_executor();
+    work_stealing_executor(work_stealing_executor const&) = delete;
+    work_stealing_executor& operator= (work_stealing_executor const&) = delete;
+
+    /// Schedules the function for execution
+    template<typename Function>
+    void post(Function&& function)
+    {
+      submit(new detail::executor_task_impl<std::decay_t<Function>>(
+        std::forward<Function>(function)));
+    }
+
+    /// Schedules the function on the given worker,
+    /// an unknown worker falls back to post().
+    template<typename Function>
+    void post_to(std::size_t worker, Function&& function)
+    {
+      submit_to(worker, new detail::executor_task_impl<std::decay_t<Function>>(
+        std::forward<Function>(function)));
+    }
+
+    /// Schedules the function behind the pending work of the executor,
+    /// it isn't taken back by the posting thread in LIFO order.
+    template<typename Function>
+    void defer(Function&& function)
+    {
+      inject(new detail::executor_task_impl<std::decay_t<Function>>(
+        std::forward<Function>(function)));
+    }
+
+    /// Invokes the function in place when called from a thread
+    /// of the executor, otherwise it's posted.
+    template<typename Function>
+    void dispatch(Function&& function)
+    {
+      if (running_in_this_thread())
+        std::forward<Function>(function)();
+      else
+        post(std::forward<Function>(function));
+    }
+
+    /// Returns the count of threads which may run the executor at once
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    /// Returns true when the calling thread runs this executor
+    bool running_in_this_thread() const noexcept;
+
+    /// Returns the index of the worker which runs on the calling thread,
+    /// or no_worker when the thread doesn't run this executor.
+    std::size_t current_worker() const noexcept;
+
+    /// Runs tasks on the calling thread until the executor was stopped
+    /// or ran out of work, returns the count of executed tasks.
+    /// Throws a std::length_error when the executor is run by
+    /// more threads than its capacity.
+    std::size_t run();
+
+    /// Runs the ready tasks on the calling thread without waiting
+    /// for further tasks, returns the count of executed tasks.
+    std::size_t poll();
+
+    void stop();
+    bool stopped() const noexcept;
+    void restart();
+    void reset() { restart(); }
+
+  private:
+    void submit(detail::executor_task* task);
+    void submit_to(std::size_t index, detail::executor_task* task);
+    void inject(detail::executor_task* task);
+    void finish() noexcept;
+    std::size_t run_tasks(bool wait);
+    detail::executor_task* next_task(worker& self);
+    detail::executor_task* pop_injected();
+    detail::executor_task* pop_mailbox(worker& target);
+    detail::executor_task* steal(worker& self);
+    bool is_stealable(worker const& target) const noexcept;
+    bool has_foreign_mail(worker const& self) const noexcept;
+    void mark_starving(worker const& self) noexcept;
+    bool has_pending(worker const& self) const noexcept;
+    bool park(worker& self);
+    void wake_one();
+    void wake_all();
+    bool wake(worker& target);
+    worker& acquire_worker();
+  };
+} // namespace awf
+
+#endif // INCLUDED_AWAITIFY_WORK_STEALING_EXECUTOR_HPP
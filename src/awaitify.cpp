@@ -1,4 +1,3 @@
-
 //  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
 //     Distributed under the Boost Software License, Version 1.0
 //       (See accompanying file LICENSE_1_0.txt or copy at
@@ -6,47 +5,2604 @@
 
 #include "awaitify/awaitify.hpp"
 
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <condition_variable>
+#include <boost/context/fixedsize_stack.hpp>
+#ifdef __linux__
+  #include <pthread.h>
+  #include <sched.h>
+#endif // __linux__
+
 namespace awf {
   #ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
-    executor& awf::system_scheduler()
+    executor& system_scheduler()
     {
       static executor instance;
       return instance;
     }
   #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
 
-  shared_execution_context& current_execution_context()
+  namespace {
+    std::atomic<std::size_t> stack_pool_size(
+      boost::context::stack_traits::default_size());
+    std::atomic<std::size_t> stack_pool_depth(64);
+
+    class stack_pool
+    {
+      std::vector<boost::context::stack_context> stacks_;
+      // Stacks which are released while the thread exits
+      // aren't pooled anymore.
+      bool closed_ = false;
+
+    public:
+      ~stack_pool()
+      {
+        for (auto& stack : stacks_)
+          release(stack);
+        stacks_.clear();
+        closed_ = true;
+      }
+
+      boost::context::stack_context acquire()
+      {
+        auto const size = stack_pool_size.load(std::memory_order_relaxed);
+        while (!stacks_.empty())
+        {
+          auto stack = stacks_.back();
+          stacks_.pop_back();
+          if (stack.size == size)
+            return stack;
+
+          // The stack size was reconfigured
+          release(stack);
+        }
+        return boost::context::fixedsize_stack(size).allocate();
+      }
+
+      void recycle(boost::context::stack_context& stack)
+      {
+        if (!closed_
+            && (stacks_.size() < stack_pool_depth.load(std::memory_order_relaxed))
+            && (stack.size == stack_pool_size.load(std::memory_order_relaxed)))
+          stacks_.push_back(stack);
+        else
+          release(stack);
+      }
+
+    private:
+      static void release(boost::context::stack_context& stack)
+      {
+        boost::context::fixedsize_stack(stack.size).deallocate(stack);
+      }
+    };
+
+    stack_pool& current_stack_pool()
+    {
+      static thread_local stack_pool instance;
+      return instance;
+    }
+  } // namespace
+
+  namespace {
+    // Recycled blocks are grouped into size classes,
+    // bigger blocks are passed to the global allocator directly.
+    std::size_t const recycler_granularity = 64;
+    std::size_t const recycler_classes = 16;
+    std::size_t const recycler_depth = 256;
+
+    class recycler;
+
+    // Set when the recyclers were released on process exit,
+    // blocks are passed to the global allocator from then on.
+    std::atomic<bool> recyclers_released(false);
+
+    struct alignas(alignof(std::max_align_t)) block_header
+    {
+      recycler* owner;
+      block_header* next;
+    };
+
+    class recycler
+    {
+      struct size_class
+      {
+        block_header* local = nullptr;
+        std::size_t count = 0;
+        std::atomic<block_header*> remote{nullptr};
+      };
+
+      size_class classes_[recycler_classes];
+
+    public:
+      ~recycler()
+      {
+        for (auto& cls : classes_)
+        {
+          release(cls.local);
+          release(cls.remote.load());
+        }
+      }
+
+      void* allocate(std::size_t index)
+      {
+        auto& cls = classes_[index];
+        if (!cls.local)
+          adopt(index);
+
+        if (auto block = cls.local)
+        {
+          cls.local = block->next;
+          --cls.count;
+          return block + 1;
+        }
+
+        auto block = static_cast<block_header*>(::operator new(
+          sizeof(block_header) + (index + 1) * recycler_granularity));
+        block->owner = this;
+        return block + 1;
+      }
+
+      /// Returns a block from the thread which owns this recycler
+      void deallocate(block_header* block, std::size_t index) noexcept
+      {
+        auto& cls = classes_[index];
+        if (cls.count < recycler_depth)
+        {
+          block->next = cls.local;
+          cls.local = block;
+          ++cls.count;
+        }
+        else
+          ::operator delete(block);
+      }
+
+      /// Returns a block from any other thread
+      void deallocate_remote(block_header* block, std::size_t index) noexcept
+      {
+        auto& remote = classes_[index].remote;
+        block->next = remote.load(std::memory_order_relaxed);
+        while (!remote.compare_exchange_weak(block->next, block,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) { }
+      }
+
+    private:
+      /// Moves the blocks which were returned by other threads
+      /// into the local free-list.
+      void adopt(std::size_t index) noexcept
+      {
+        auto block = classes_[index].remote.exchange(
+          nullptr, std::memory_order_acquire);
+        while (block)
+        {
+          auto next = block->next;
+          deallocate(block, index);
+          block = next;
+        }
+      }
+
+      static void release(block_header* block) noexcept
+      {
+        while (block)
+        {
+          auto next = block->next;
+          ::operator delete(block);
+          block = next;
+        }
+      }
+    };
+
+    /// Keeps the recyclers alive until the process exits since blocks
+    /// may be returned to them after their thread has finished.
+    /// Recyclers of finished threads are handed over to new threads.
+    class recycler_registry
+    {
+      std::mutex mutex_;
+      std::vector<std::unique_ptr<recycler>> recyclers_;
+      std::vector<recycler*> abandoned_;
+
+    public:
+      ~recycler_registry()
+      {
+        recyclers_released = true;
+      }
+
+      recycler* acquire()
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!abandoned_.empty())
+        {
+          auto instance = abandoned_.back();
+          abandoned_.pop_back();
+          return instance;
+        }
+        recyclers_.push_back(std::make_unique<recycler>());
+        return recyclers_.back().get();
+      }
+
+      void abandon(recycler* instance)
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        abandoned_.push_back(instance);
+      }
+    };
+
+    recycler_registry& current_recycler_registry()
+    {
+      static recycler_registry instance;
+      return instance;
+    }
+
+    struct recycler_handle
+    {
+      recycler* instance;
+
+      recycler_handle()
+        : instance(current_recycler_registry().acquire()) { }
+      ~recycler_handle()
+      {
+        current_recycler_registry().abandon(instance);
+        instance = nullptr;
+      }
+    };
+
+    /// Returns the recycler of the calling thread or a null pointer
+    /// when the thread is exiting already.
+    recycler* current_recycler()
+    {
+      static thread_local recycler_handle handle;
+      return recyclers_released ? nullptr : handle.instance;
+    }
+
+    bool is_recyclable(std::size_t size)
+    {
+      return size <= (recycler_classes * recycler_granularity);
+    }
+
+    std::size_t size_class_of(std::size_t size)
+    {
+      return size ? ((size - 1) / recycler_granularity) : 0;
+    }
+  } // namespace
+
+  void* detail::allocate_recycled(std::size_t size)
   {
-    static thread_local shared_execution_context instance;
-    return instance;
+    if (!is_recyclable(size))
+      return ::operator new(size);
+
+    auto const index = size_class_of(size);
+    if (auto recycler = current_recycler())
+      return recycler->allocate(index);
+
+    auto header = static_cast<block_header*>(::operator new(
+      sizeof(block_header) + (index + 1) * recycler_granularity));
+    header->owner = nullptr;
+    return header + 1;
   }
 
-  void execution_context::weak_enter()
+  void detail::deallocate_recycled(void* block, std::size_t size) noexcept
   {
-    assert(!current_execution_context() &&
-           "Context already in use!");
-    current_execution_context() = shared_from_this();
+    if (!is_recyclable(size))
+      return ::operator delete(block);
+
+    auto header = static_cast<block_header*>(block) - 1;
+    auto recycler = current_recycler();
+    if (!header->owner || !recycler)
+      ::operator delete(header);
+    else if (header->owner == recycler)
+      recycler->deallocate(header, size_class_of(size));
+    else
+      header->owner->deallocate_remote(header, size_class_of(size));
   }
 
-  void execution_context::resume()
+  stack_pool_options stack_pool_configuration()
   {
-    weak_enter();
-    (*push_)();
-    weak_leave();
+    return { stack_pool_size.load(), stack_pool_depth.load() };
   }
 
-  void execution_context::weak_leave()
+  void configure_stack_pool(stack_pool_options const& options)
   {
-    assert(current_execution_context() &&
-           "No context in use!");
-    current_execution_context().reset();
+    assert(options.stack_size >=
+             boost::context::stack_traits::minimum_size() &&
+           "The stack size is too small!");
+    stack_pool_size = options.stack_size;
+    stack_pool_depth = options.depth;
   }
 
-  void execution_context::suspend()
+  boost::context::stack_context pooled_stack_allocator::allocate()
   {
-    assert(current_execution_context() &&
-           "Invalid context of execution.");
+    if (!prepared_.sp)
+      return current_stack_pool().acquire();
 
-    (*pull_)();
+    // The coroutine starts below the reserved bytes
+    auto stack = prepared_;
+    stack.sp = static_cast<char*>(stack.sp) - reserved_;
+    stack.size -= reserved_;
+    return stack;
+  }
+
+  void pooled_stack_allocator::deallocate(
+    boost::context::stack_context& stack) noexcept
+  {
+    // Prepared stacks are released by their owner
+    if (!prepared_.sp)
+      current_stack_pool().recycle(stack);
+  }
+
+  namespace {
+    std::atomic<resume_mode> resume_policy(resume_mode::post);
+    std::atomic<std::size_t> resume_max_depth(16);
+    std::atomic<bool> resume_affinity(true);
+
+    /// The count of directly resumed contexts on the current thread
+    std::size_t& current_resume_depth()
+    {
+      static thread_local std::size_t depth = 0;
+      return depth;
+    }
+  } // namespace
+
+  resume_options resume_configuration()
+  {
+    return { resume_policy.load(), resume_max_depth.load(),
+             resume_affinity.load() };
+  }
+
+  void configure_resume(resume_options const& options)
+  {
+    resume_policy = options.mode;
+    resume_max_depth = options.max_depth;
+    resume_affinity = options.affinity;
+  }
+
+  namespace {
+    /// \brief Resume counters of a group of threads
+    ///
+    /// Threads count into the slot of their token, so the counters
+    /// are only shared by threads beyond the count of slots.
+    struct alignas(64) resume_counter_slot
+    {
+      std::atomic<std::uint64_t> resumes;
+      std::atomic<std::uint64_t> migrations;
+      std::atomic<std::uint64_t> preemptions;
+      // The queue wait latency by priority class
+      std::atomic<std::uint64_t> dequeued[3];
+      std::atomic<std::uint64_t> total_wait[3];
+      std::atomic<std::uint64_t> max_wait[3];
+    };
+
+    std::size_t const resume_counter_slots = 64;
+    resume_counter_slot resume_counters_of[resume_counter_slots];
+
+    std::atomic<std::uint32_t> thread_tokens(0);
+
+    /// Returns a non zero token which identifies the calling thread
+    std::uint32_t current_thread_token()
+    {
+      static thread_local std::uint32_t const token =
+        thread_tokens.fetch_add(1, std::memory_order_relaxed) + 1;
+      return token;
+    }
+
+    resume_counter_slot& current_resume_counters()
+    {
+      return resume_counters_of[
+        (current_thread_token() - 1) % resume_counter_slots];
+    }
+
+    /// Executors without per-thread queues don't have home workers
+    template<typename Executor>
+    std::uint32_t current_home_worker(Executor&)
+    {
+      return 0;
+    }
+
+    template<typename Executor, typename Function>
+    void post_to_home_worker(Executor& scheduler, std::uint32_t /*home*/,
+                             Function&& function)
+    {
+      scheduler.post(std::forward<Function>(function));
+    }
+
+    /// Returns true when the calling thread runs the executor
+    template<typename Executor>
+    bool runs_executor(Executor& scheduler)
+    {
+      return scheduler.get_executor().running_in_this_thread();
+    }
+
+    /// Returns the count of threads which may run the executor at once
+    template<typename Executor>
+    std::size_t capacity_of(Executor&)
+    {
+      return std::numeric_limits<std::size_t>::max();
+    }
+
+    /// The queue of executors without per-thread queues is FIFO already
+    template<typename Executor, typename Function>
+    void post_behind_pending_work(Executor& scheduler, Function&& function)
+    {
+      scheduler.post(std::forward<Function>(function));
+    }
+
+  #ifdef AWAITIFY_PROVIDE_EXECUTOR_TYPE
+    std::size_t capacity_of(work_stealing_executor& scheduler)
+    {
+      return scheduler.capacity();
+    }
+
+    bool runs_executor(work_stealing_executor& scheduler)
+    {
+      return scheduler.running_in_this_thread();
+    }
+
+    std::uint32_t current_home_worker(work_stealing_executor& scheduler)
+    {
+      auto const worker = scheduler.current_worker();
+      return worker == work_stealing_executor::no_worker ?
+        0 : std::uint32_t(worker + 1);
+    }
+
+    template<typename Function>
+    void post_to_home_worker(work_stealing_executor& scheduler,
+                             std::uint32_t home, Function&& function)
+    {
+      if (home)
+        scheduler.post_to(home - 1, std::forward<Function>(function));
+      else
+        scheduler.post(std::forward<Function>(function));
+    }
+
+    /// Bypasses the deque of the worker, which is taken back in LIFO order
+    template<typename Function>
+    void post_behind_pending_work(work_stealing_executor& scheduler,
+                                  Function&& function)
+    {
+      scheduler.defer(std::forward<Function>(function));
+    }
+  #endif // AWAITIFY_PROVIDE_EXECUTOR_TYPE
+  } // namespace
+
+  resume_counters resume_statistics()
+  {
+    resume_counters counters{ 0, 0, 0 };
+    for (auto const& slot : resume_counters_of)
+    {
+      counters.resumes += slot.resumes.load(std::memory_order_relaxed);
+      counters.migrations += slot.migrations.load(std::memory_order_relaxed);
+      counters.preemptions +=
+        slot.preemptions.load(std::memory_order_relaxed);
+    }
+    return counters;
+  }
+
+  std::size_t resume_depth() noexcept
+  {
+    return current_resume_depth();
+  }
+
+  namespace {
+    std::atomic<std::size_t> priority_high_burst(8);
+    std::atomic<std::size_t> priority_low_deferrals(1);
+
+    /// Resumes the owned context when invoked
+    struct resumer
+    {
+      shared_execution_context context;
+
+      void operator() ()
+      {
+        execution_context::resume(std::move(context));
+      }
+    };
+
+    using queue_clock = std::chrono::steady_clock;
+
+    void record_queue_wait(priority level, queue_clock::duration wait)
+    {
+      auto const index = std::size_t(level);
+      auto const ns = std::uint64_t(std::max<std::int64_t>(0,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count()));
+
+      auto& counters = current_resume_counters();
+      counters.dequeued[index].fetch_add(1, std::memory_order_relaxed);
+      counters.total_wait[index].fetch_add(ns, std::memory_order_relaxed);
+      auto max = counters.max_wait[index].load(std::memory_order_relaxed);
+      while ((max < ns) && !counters.max_wait[index].compare_exchange_weak(
+               max, ns, std::memory_order_relaxed))
+        ;
+    }
+  } // namespace
+
+  priority_options priority_configuration()
+  {
+    return { priority_high_burst.load(), priority_low_deferrals.load() };
+  }
+
+  void configure_priorities(priority_options const& options)
+  {
+    priority_high_burst = options.high_burst;
+    priority_low_deferrals = options.low_deferrals;
+  }
+
+  priority_counters priority_statistics(priority level)
+  {
+    auto const index = std::size_t(level);
+    std::uint64_t dequeued = 0;
+    std::uint64_t total = 0;
+    std::uint64_t max = 0;
+    for (auto const& slot : resume_counters_of)
+    {
+      dequeued += slot.dequeued[index].load(std::memory_order_relaxed);
+      total += slot.total_wait[index].load(std::memory_order_relaxed);
+      max = std::max(max, slot.max_wait[index].load(std::memory_order_relaxed));
+    }
+    return { dequeued, std::chrono::nanoseconds(total),
+             std::chrono::nanoseconds(max) };
+  }
+
+  namespace {
+    std::atomic<std::size_t> budget_ready_awaits(0);
+    std::atomic<std::chrono::microseconds::rep> budget_run_time(0);
+  } // namespace
+
+  budget_options budget_configuration()
+  {
+    return { budget_ready_awaits.load(),
+             std::chrono::microseconds(budget_run_time.load()) };
+  }
+
+  void configure_budget(budget_options const& options)
+  {
+    budget_ready_awaits = options.ready_awaits;
+    budget_run_time = options.run_time.count();
+  }
+
+  namespace {
+    std::atomic<void (*)(std::exception_ptr)> detached_on_exception(nullptr);
+  } // namespace
+
+  detached_options detached_configuration()
+  {
+    return { detached_on_exception.load() };
+  }
+
+  void configure_detached(detached_options const& options)
+  {
+    detached_on_exception = options.on_exception;
+  }
+
+  void detail::handle_detached_exception(std::exception_ptr exception)
+  {
+    auto const handler = detached_on_exception.load(std::memory_order_acquire);
+    if (!handler)
+      std::terminate();
+    handler(std::move(exception));
+  }
+
+  namespace {
+    std::atomic<std::size_t> admission_limit(0);
+    std::atomic<admission_policy> admission_mode(admission_policy::wait);
+    std::atomic<std::size_t> admission_live(0);
+    /// The count of queued waiters, releases only lock while it's non zero
+    std::atomic<std::size_t> admission_waiting(0);
+    std::atomic<std::uint64_t> admission_awaited(0);
+    std::atomic<std::uint64_t> admission_blocked(0);
+    std::atomic<std::uint64_t> admission_rejected(0);
+
+    /// \brief A spawn which waits for a slot of the live context limit
+    struct admission_waiter
+    {
+      /// The suspended spawning context, nullptr for blocked threads
+      shared_execution_context context;
+      bool admitted;
+      admission_waiter* next;
+    };
+
+    /// \brief Waiters for a slot in FIFO order, the waiters live on the
+    /// stack of their spawn and are linked intrusively.
+    struct admission_queue
+    {
+      std::mutex mutex;
+      std::condition_variable condition;
+      admission_waiter* head = nullptr;
+      admission_waiter* tail = nullptr;
+
+      void push_back(admission_waiter* waiter) noexcept
+      {
+        waiter->next = nullptr;
+        (tail ? tail->next : head) = waiter;
+        tail = waiter;
+      }
+
+      void push_front(admission_waiter* waiter) noexcept
+      {
+        waiter->next = head;
+        head = waiter;
+        if (!tail)
+          tail = waiter;
+      }
+
+      admission_waiter* pop_front() noexcept
+      {
+        auto const waiter = head;
+        head = waiter->next;
+        if (!head)
+          tail = nullptr;
+        return waiter;
+      }
+    };
+
+    admission_queue& current_admission_queue()
+    {
+      // Leaked intentionally, contexts may be released after static objects
+      static auto const queue = new admission_queue();
+      return *queue;
+    }
+
+    /// Takes a slot when the count of live contexts is below the limit
+    bool try_admit() noexcept
+    {
+      auto const limit = admission_limit.load(std::memory_order_relaxed);
+      auto live = admission_live.load(std::memory_order_relaxed);
+      do
+      {
+        if (limit && (live >= limit))
+          return false;
+      }
+      while (!admission_live.compare_exchange_weak(live, live + 1,
+        std::memory_order_seq_cst, std::memory_order_relaxed));
+      return true;
+    }
+
+    /// Hands free slots over to the waiters in FIFO order
+    ///
+    /// Reached from the destructor of contexts, so it doesn't throw.
+    /// A waiter whose resumption can't be scheduled is queued in front
+    /// again together with its slot, the next release retries it.
+    void admit_waiters() noexcept
+    {
+      auto& queue = current_admission_queue();
+      for (;;)
+      {
+        admission_waiter* waiter;
+        shared_execution_context context;
+        {
+          std::lock_guard<std::mutex> lock(queue.mutex);
+          if (!queue.head || !try_admit())
+            return;
+          waiter = queue.pop_front();
+          admission_waiting.fetch_sub(1, std::memory_order_seq_cst);
+          if (!waiter->context)
+          {
+            waiter->admitted = true;
+            queue.condition.notify_all();
+            continue;
+          }
+          context = std::move(waiter->context);
+        }
+
+        // The waiter is released by its resumption, so the context
+        // is only moved back when scheduling failed.
+        try
+        {
+          execution_context::schedule(shared_execution_context(context));
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(queue.mutex);
+          waiter->context = std::move(context);
+          queue.push_front(waiter);
+          admission_waiting.fetch_add(1, std::memory_order_seq_cst);
+          admission_live.fetch_sub(1, std::memory_order_seq_cst);
+          return;
+        }
+      }
+    }
+  } // namespace
+
+  admission_options admission_configuration()
+  {
+    return { admission_limit.load(), admission_mode.load() };
+  }
+
+  void configure_admission(admission_options const& options)
+  {
+    admission_limit = options.max_contexts;
+    admission_mode = options.policy;
+    admit_waiters();
+  }
+
+  admission_counters admission_statistics()
+  {
+    return { admission_live.load(), admission_awaited.load(),
+             admission_blocked.load(), admission_rejected.load() };
+  }
+
+  namespace detail {
+    /// \brief Multi-level queue of an executor
+    ///
+    /// Normal work stays in the FIFO queue of the executor, the high and
+    /// low priority classes are queued here and a token is posted to the
+    /// executor per task. Normal resumptions run up to high_burst queued
+    /// high priority tasks in front of them, tokens of low priority tasks
+    /// are requeued low_deferrals times before they run.
+    /// Queues are kept for the lifetime of the process, since tokens
+    /// may still be pending on a stopped executor.
+    class scheduler_queue
+    {
+      /// \brief Token of a queued task which is posted to the executor
+      ///
+      /// A token which is destroyed without running, because its executor
+      /// was destroyed, destroys a queued task of its priority class,
+      /// so the queue never holds more tasks than tokens are pending.
+      class token
+      {
+        scheduler_queue* queue_;
+        priority level_;
+        std::size_t laps_;
+
+      public:
+        token(scheduler_queue& queue, priority level, std::size_t laps) noexcept
+          : queue_(&queue), level_(level), laps_(laps) { }
+        token(token const&) = delete;
+        token& operator= (token const&) = delete;
+        ~token()
+        {
+          if (queue_)
+            queue_->drop_one(level_);
+        }
+
+        void operator() ()
+        {
+          auto& queue = *std::exchange(queue_, nullptr);
+          if ((level_ == priority::low) &&
+              (laps_ < priority_low_deferrals.load(std::memory_order_relaxed)))
+            queue.post_token(level_, laps_ + 1);
+          else
+            queue.run_one(level_);
+        }
+      };
+
+      struct entry
+      {
+        executor_task* task;
+        queue_clock::time_point enqueued;
+      };
+
+      executor& scheduler_;
+      std::mutex mutex_;
+      std::deque<entry> high_;
+      std::deque<entry> low_;
+      std::atomic<std::size_t> high_pending_;
+
+    public:
+      explicit scheduler_queue(executor& scheduler)
+        : scheduler_(scheduler), high_pending_(0) { }
+
+      executor& scheduler() const noexcept { return scheduler_; }
+
+      void push(priority level, executor_task* task)
+      {
+        assert(level != priority::normal &&
+               "Normal work is posted to the executor directly!");
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          (level == priority::high ? high_ : low_)
+            .push_back({ task, queue_clock::now() });
+          if (level == priority::high)
+            high_pending_.fetch_add(1, std::memory_order_relaxed);
+        }
+        post_token(level, 0);
+      }
+
+      /// Runs queued high priority tasks in front of a normal resumption
+      void run_high_priority()
+      {
+        auto const burst =
+          priority_high_burst.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < burst; ++i)
+          if (!high_pending_.load(std::memory_order_relaxed) ||
+              !run_one(priority::high))
+            break;
+      }
+
+    private:
+      void post_token(priority level, std::size_t laps)
+      {
+        // The scheduler requires copyable handlers
+        auto posted = std::make_shared<token>(*this, level, laps);
+        // Deferred tokens aren't taken back by the worker in LIFO order
+        if (laps)
+          post_behind_pending_work(scheduler_, [posted] { (*posted)(); });
+        else
+          scheduler_.post([posted] { (*posted)(); });
+      }
+
+      /// Runs the oldest task of the priority class, the task of a token
+      /// may have been run in front of a normal resumption already.
+      bool run_one(priority level)
+      {
+        entry current;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          auto& queue = (level == priority::high) ? high_ : low_;
+          if (queue.empty())
+            return false;
+          current = queue.front();
+          queue.pop_front();
+          if (level == priority::high)
+            high_pending_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        record_queue_wait(level, queue_clock::now() - current.enqueued);
+        current.task->run();
+        return true;
+      }
+
+      /// Destroys the oldest task of the priority class without running it
+      void drop_one(priority level) noexcept
+      {
+        executor_task* task;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          auto& queue = (level == priority::high) ? high_ : low_;
+          if (queue.empty())
+            return;
+          task = queue.front().task;
+          queue.pop_front();
+          if (level == priority::high)
+            high_pending_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        task->destroy();
+      }
+    };
+
+    // Looked up when a context is bound, contexts keep the queue
+    // of their executor for their resumptions.
+    scheduler_queue& scheduler_queue_of(executor& scheduler)
+    {
+      static thread_local scheduler_queue* cached = nullptr;
+      if (cached && (&cached->scheduler() == &scheduler))
+        return *cached;
+
+      static std::mutex mutex;
+      // Leaked intentionally, pending tokens may outlive static objects
+      static auto const queues =
+        new std::vector<std::unique_ptr<scheduler_queue>>();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      auto const itr = std::find_if(queues->begin(), queues->end(),
+        [&](auto const& queue) { return &queue->scheduler() == &scheduler; });
+      if (itr != queues->end())
+        cached = itr->get();
+      else
+      {
+        queues->emplace_back(new scheduler_queue(scheduler));
+        cached = queues->back().get();
+      }
+      return *cached;
+    }
+
+    void enqueue_prioritized(scheduler_queue& queue, priority level,
+                             executor_task* task)
+    {
+      queue.push(level, task);
+    }
+
+    void run_high_priority(scheduler_queue& queue)
+    {
+      queue.run_high_priority();
+    }
+  } // namespace detail
+
+  namespace {
+    /// Resumes a context of normal priority after the queued
+    /// high priority work of its executor.
+    struct queued_resumer
+    {
+      shared_execution_context context;
+      detail::scheduler_queue* queue;
+      queue_clock::time_point enqueued;
+
+      void operator() ()
+      {
+        assert(context &&
+               "Execution context is invalid!");
+        record_queue_wait(priority::normal, queue_clock::now() - enqueued);
+        queue->run_high_priority();
+        execution_context::resume(std::move(context));
+      }
+    };
+  } // namespace
+
+  namespace detail {
+    /// \brief Hierarchical timer wheel which is driven by a dedicated
+    /// thread, independently of the executors of the contexts.
+    ///
+    /// Every level consists of 64 slots, a slot of the lowest level
+    /// spans one tick, a slot of a higher level spans all slots of
+    /// the level below. The entries of a slot are cascaded down
+    /// whenever the level below wraps around, inserting and cancelling
+    /// an entry are constant time list operations.
+    /// The driver thread is started with the first timer and invokes
+    /// the callbacks of the expired entries, it's joined when the
+    /// wheel is destroyed.
+    class timer_wheel
+    {
+      using clock = std::chrono::steady_clock;
+      /// The resolution of the wheel
+      using tick = std::chrono::milliseconds;
+
+      static std::size_t const slot_bits = 6;
+      static std::size_t const slot_count = std::size_t(1) << slot_bits;
+      static std::size_t const level_count = 4;
+      static std::uint64_t const horizon =
+        std::uint64_t(1) << (slot_bits * level_count);
+
+      std::mutex mutex_;
+      clock::time_point const epoch_;
+      /// The tick which was processed last
+      std::uint64_t current_;
+      /// The tick the driver is armed for, zero while it's idle
+      std::uint64_t armed_;
+      std::size_t size_;
+      std::uint64_t occupied_[level_count];
+      timer_link slots_[level_count][slot_count];
+      bool stopping_;
+      std::condition_variable wakeup_;
+      std::thread driver_;
+
+    public:
+      timer_wheel()
+        : epoch_(clock::now()), current_(0), armed_(0), size_(0),
+          occupied_(), stopping_(false)
+      {
+        for (auto& level : slots_)
+          for (auto& slot : level)
+            slot.prev = slot.next = &slot;
+      }
+
+      ~timer_wheel()
+      {
+        std::thread driver;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          stopping_ = true;
+          driver = std::move(driver_);
+        }
+        wakeup_.notify_one();
+        if (driver.joinable())
+        {
+          // An expiry callback which exits the process can't join itself
+          if (driver.get_id() == std::this_thread::get_id())
+            driver.detach();
+          else
+            driver.join();
+        }
+
+        timer_link abandoned;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          for (std::size_t level = 0; level < level_count; ++level)
+            for (std::size_t slot = 0; slot < slot_count; ++slot)
+              while (slots_[level][slot].next != &slots_[level][slot])
+                push(abandoned, unlink(
+                  static_cast<timer_entry*>(slots_[level][slot].next)));
+        }
+        invoke(abandoned, false);
+      }
+
+      void insert(timer_entry& entry, clock::time_point deadline)
+      {
+        // Rounds up, timers never expire early
+        auto const ticks = std::chrono::duration_cast<tick>(
+          deadline - epoch_ + tick(1) - clock::duration(1)).count();
+        entry.expiry_ = ticks > 0 ? std::uint64_t(ticks) : 0;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        // The current tick was processed already
+        auto const wakeup = link(entry, std::max(entry.expiry_, current_ + 1));
+        if (armed_ && (armed_ <= wakeup))
+          return;
+
+        armed_ = wakeup;
+        if (driver_.joinable())
+          wakeup_.notify_one();
+        else if (!stopping_)
+          driver_ = std::thread([this] { drive(); });
+      }
+
+      bool cancel(timer_entry& entry) noexcept
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Expired entries are unlinked before their callback is invoked
+        if (!entry.prev)
+          return false;
+
+        unlink(&entry);
+        return true;
+      }
+
+    private:
+      /// Links the entry into the slot which covers the expiry,
+      /// returns the tick at which the slot is processed.
+      std::uint64_t link(timer_entry& entry, std::uint64_t expiry)
+      {
+        if (expiry - current_ >= horizon)
+          expiry = current_ + horizon - 1;
+
+        std::size_t level = 0;
+        while ((level + 1 < level_count) &&
+               ((expiry - current_) >> (slot_bits * (level + 1))))
+          ++level;
+
+        auto const shift = slot_bits * level;
+        auto const slot = (expiry >> shift) & (slot_count - 1);
+        auto& head = slots_[level][slot];
+        entry.prev = head.prev;
+        entry.next = &head;
+        head.prev->next = &entry;
+        head.prev = &entry;
+        occupied_[level] |= std::uint64_t(1) << slot;
+        ++size_;
+        return (expiry >> shift) << shift;
+      }
+
+      timer_entry* unlink(timer_entry* entry) noexcept
+      {
+        auto const prev = entry->prev;
+        prev->next = entry->next;
+        entry->next->prev = prev;
+        entry->prev = entry->next = nullptr;
+        --size_;
+
+        // Only the head of the slot remains
+        if (prev == prev->next)
+        {
+          auto const index = std::size_t(prev - &slots_[0][0]);
+          occupied_[index / slot_count] &=
+            ~(std::uint64_t(1) << (index % slot_count));
+        }
+        return entry;
+      }
+
+      /// Pushes an unlinked entry onto the singly linked list
+      static void push(timer_link& list, timer_entry* entry) noexcept
+      {
+        entry->next = list.next;
+        list.next = entry;
+      }
+
+      static void invoke(timer_link& list, bool expired)
+      {
+        for (auto current = list.next; current;)
+        {
+          auto const entry = static_cast<timer_entry*>(current);
+          // The callback may release the entry
+          current = std::exchange(entry->next, nullptr);
+          entry->callback_(entry->data_, expired);
+        }
+      }
+
+      /// Processes all ticks up to the given one
+      void advance(std::uint64_t target, timer_link& expired)
+      {
+        while (current_ < target)
+        {
+          if (!size_)
+          {
+            current_ = target;
+            break;
+          }
+
+          // Skips the empty ticks until the next cascade
+          if (!occupied_[0])
+            current_ = std::min(target - 1, current_ | (slot_count - 1));
+
+          ++current_;
+          for (auto level = level_count - 1; level > 0; --level)
+          {
+            auto const shift = slot_bits * level;
+            if (current_ & ((std::uint64_t(1) << shift) - 1))
+              continue;
+
+            auto& head = slots_[level][(current_ >> shift) & (slot_count - 1)];
+            while (head.next != &head)
+            {
+              auto const entry = unlink(static_cast<timer_entry*>(head.next));
+              link(*entry, std::max(entry->expiry_, current_));
+            }
+          }
+
+          auto& head = slots_[0][current_ & (slot_count - 1)];
+          while (head.next != &head)
+            push(expired, unlink(static_cast<timer_entry*>(head.next)));
+        }
+      }
+
+      /// Returns the next tick at which an entry expires or cascades
+      std::uint64_t next_wakeup() const noexcept
+      {
+        auto wakeup = std::numeric_limits<std::uint64_t>::max();
+        for (std::size_t distance = 1; distance <= slot_count; ++distance)
+          if (occupied_[0] &
+              (std::uint64_t(1) << ((current_ + distance) & (slot_count - 1))))
+          {
+            wakeup = current_ + distance;
+            break;
+          }
+
+        for (std::size_t level = 1; level < level_count; ++level)
+          if (occupied_[level])
+          {
+            auto const shift = slot_bits * level;
+            return std::min(wakeup, ((current_ >> shift) + 1) << shift);
+          }
+        return wakeup;
+      }
+
+      /// Sleeps until the armed tick and processes the expired entries,
+      /// an earlier insertion wakes the driver up to rearm it.
+      void drive()
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_)
+        {
+          if (!armed_)
+          {
+            wakeup_.wait(lock);
+            continue;
+          }
+
+          auto const now = std::chrono::duration_cast<tick>(
+            clock::now() - epoch_).count();
+          if (std::uint64_t(now) < armed_)
+          {
+            wakeup_.wait_until(lock, epoch_ + tick(armed_));
+            continue;
+          }
+
+          timer_link expired;
+          advance(std::uint64_t(now), expired);
+          armed_ = size_ ? next_wakeup() : 0;
+
+          lock.unlock();
+          invoke(expired, true);
+          lock.lock();
+        }
+      }
+    };
+
+    std::atomic<bool> timers_released(false);
+
+    struct timer_wheel_holder
+    {
+      timer_wheel wheel;
+
+      ~timer_wheel_holder()
+      {
+        timers_released = true;
+      }
+    };
+
+    timer_wheel& current_timer_wheel()
+    {
+      static timer_wheel_holder instance;
+      return instance.wheel;
+    }
+
+    void schedule_timer(timer_entry& entry,
+                        std::chrono::steady_clock::time_point deadline)
+    {
+      if (timers_released.load(std::memory_order_acquire))
+        entry.callback_(entry.data_, false);
+      else
+        current_timer_wheel().insert(entry, deadline);
+    }
+
+    bool cancel_timer(timer_entry& entry) noexcept
+    {
+      if (timers_released.load(std::memory_order_acquire))
+        return false;
+      return current_timer_wheel().cancel(entry);
+    }
+  } // namespace detail
+
+  void sleep_until(std::chrono::steady_clock::time_point deadline)
+  {
+    if (deadline <= std::chrono::steady_clock::now())
+      return;
+
+    assert(current_execution_context() &&
+           "Sleep isn't dispatched in a coroutine!" &&
+           "Use `asyncify` to create an awaitable context!");
+
+    // The context isn't resumed before the timer expired,
+    // which makes it safe to keep the entry on its stack.
+    shared_execution_context sleeper;
+    detail::timer_entry entry([](void* data, bool expired)
+    {
+      auto& sleeper = *static_cast<shared_execution_context*>(data);
+      if (expired)
+        execution_context::schedule(std::move(sleeper));
+      else
+        sleeper.reset();
+    }, &sleeper);
+
+    auto on_suspend = [&](shared_execution_context context)
+    {
+      sleeper = std::move(context);
+      detail::schedule_timer(entry, deadline);
+    };
+    current_execution_context()->suspend(on_suspend);
+  }
+
+  namespace {
+    std::atomic<std::int64_t> idle_spin_duration(0);
+    std::atomic<std::int64_t> idle_yield_duration(0);
+
+    std::atomic<std::uint64_t> idle_spins(0);
+    std::atomic<std::uint64_t> idle_yields(0);
+    std::atomic<std::uint64_t> idle_parks(0);
+    std::atomic<std::uint64_t> idle_wakeups(0);
+
+    /// \brief Polls through the spin and yield phase of the idle strategy
+    ///
+    /// Returns true when the poll succeeded, the counters are
+    /// accumulated locally and published once per idle phase.
+    template<typename Poll>
+    bool poll_while_idle(Poll&& poll)
+    {
+      using clock = std::chrono::steady_clock;
+
+      auto const spin = std::chrono::microseconds(
+        idle_spin_duration.load(std::memory_order_relaxed));
+      auto const yield = std::chrono::microseconds(
+        idle_yield_duration.load(std::memory_order_relaxed));
+
+      std::uint64_t spins = 0;
+      std::uint64_t yields = 0;
+      bool polled = false;
+
+      if (spin.count())
+      {
+        auto const deadline = clock::now() + spin;
+        while (!(polled = poll()) && (clock::now() < deadline))
+          ++spins;
+      }
+      if (!polled && yield.count())
+      {
+        auto const deadline = clock::now() + yield;
+        while (!polled && (clock::now() < deadline))
+        {
+          std::this_thread::yield();
+          if (!(polled = poll()))
+            ++yields;
+        }
+      }
+
+      if (spins)
+        idle_spins.fetch_add(spins, std::memory_order_relaxed);
+      if (yields)
+        idle_yields.fetch_add(yields, std::memory_order_relaxed);
+      return polled;
+    }
+
+  #ifndef AWAITIFY_PROVIDE_EXECUTOR_TYPE
+    /// Runs the io_service with the idle strategy applied
+    void run_worker(boost::asio::io_service& scheduler)
+    {
+      while (!scheduler.stopped())
+      {
+        if (scheduler.poll_one())
+          continue;
+        if (poll_while_idle([&] { return scheduler.poll_one() != 0; }))
+          continue;
+
+        idle_parks.fetch_add(1, std::memory_order_relaxed);
+        if (scheduler.run_one())
+          idle_wakeups.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  #endif // AWAITIFY_PROVIDE_EXECUTOR_TYPE
+
+    /// Executors which apply the idle strategy on their own
+    template<typename Executor>
+    void run_worker(Executor& scheduler)
+    {
+      scheduler.run();
+    }
+
+    /// Applies the name and CPU affinity of the worker to the calling thread
+    void configure_worker_thread(runtime_options const& options,
+                                 std::size_t index)
+    {
+    #ifdef __linux__
+      // Thread names are limited to 15 characters
+      auto const name = (options.name + "-" + std::to_string(index))
+        .substr(0, 15);
+      pthread_setname_np(pthread_self(), name.c_str());
+
+      if (options.pin_threads)
+      {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+          return;
+
+        auto const count = std::size_t(CPU_COUNT(&allowed));
+        if (!count)
+          return;
+
+        // Selects the n-th allowed CPU
+        std::size_t skip = index % count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+          if (CPU_ISSET(cpu, &allowed) && !skip--)
+          {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+            break;
+          }
+      }
+    #else
+      (void)options;
+      (void)index;
+    #endif // __linux__
+    }
+  } // namespace
+
+  idle_options idle_configuration()
+  {
+    return { std::chrono::microseconds(idle_spin_duration.load()),
+             std::chrono::microseconds(idle_yield_duration.load()) };
+  }
+
+  void configure_idle(idle_options const& options)
+  {
+    idle_spin_duration = options.spin.count();
+    idle_yield_duration = options.yield.count();
+  }
+
+  idle_counters idle_statistics()
+  {
+    return { idle_spins.load(), idle_yields.load(),
+             idle_parks.load(), idle_wakeups.load() };
+  }
+
+#ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
+  runtime::runtime(runtime_options options)
+    : runtime(system_scheduler(), std::move(options)) { }
+#endif // AWAITIFY_NO_SYSTEM_SCHEDULER
+
+  runtime::runtime(executor& scheduler, runtime_options options)
+    : scheduler_(scheduler), options_(std::move(options))
+  {
+    if (!options_.threads)
+      options_.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  runtime::~runtime()
+  {
+    stop();
+    join();
+  }
+
+  void runtime::start()
+  {
+    assert(threads_.empty() &&
+           "The runtime was started already!");
+    if (options_.threads > capacity_of(scheduler_))
+      throw std::length_error("The executor can't be run by that many threads!");
+
+    scheduler_.restart();
+    work_ = std::make_unique<executor::work>(scheduler_);
+
+    threads_.reserve(options_.threads);
+    for (std::size_t i = 0; i < options_.threads; ++i)
+      threads_.emplace_back([this, i]
+      {
+        configure_worker_thread(options_, i);
+        run_worker(scheduler_);
+      });
+  }
+
+  void runtime::stop()
+  {
+    work_.reset();
+    scheduler_.stop();
+  }
+
+  void runtime::join()
+  {
+    for (auto& thread : threads_)
+      thread.join();
+    threads_.clear();
+  }
+
+  namespace detail {
+    /// \brief Bounded single-producer single-consumer queue of tasks
+    /// which are posted from one shard to another.
+    class shard_queue
+    {
+      static std::size_t const capacity = 256;
+
+      // The consumer and producer indices are kept on distinct cache lines
+      std::atomic<std::size_t> head_;
+      std::size_t cached_tail_;
+      char padding_head_[64];
+      std::atomic<std::size_t> tail_;
+      std::size_t cached_head_;
+      char padding_tail_[64];
+      std::atomic<executor_task*> slots_[capacity];
+
+    public:
+      shard_queue()
+        : head_(0), cached_tail_(0), tail_(0), cached_head_(0) { }
+
+      /// Called by the producer, returns false when the queue is full
+      bool push(executor_task* task) noexcept
+      {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == capacity)
+        {
+          cached_head_ = head_.load(std::memory_order_acquire);
+          if (tail - cached_head_ == capacity)
+            return false;
+        }
+        slots_[tail % capacity].store(task, std::memory_order_relaxed);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+
+      /// Called by the consumer, returns nullptr when the queue is empty
+      executor_task* pop() noexcept
+      {
+        auto const head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_)
+        {
+          cached_tail_ = tail_.load(std::memory_order_acquire);
+          if (head == cached_tail_)
+            return nullptr;
+        }
+        auto const task = slots_[head % capacity].load(
+          std::memory_order_relaxed);
+        head_.store(head + 1, std::memory_order_release);
+        return task;
+      }
+    };
+  } // namespace detail
+
+  namespace {
+    shard*& current_shard_slot()
+    {
+      static thread_local shard* instance = nullptr;
+      return instance;
+    }
+
+    /// Owns a task which is posted through the scheduler of a shard
+    class posted_task
+    {
+      detail::executor_task* task_;
+
+    public:
+      explicit posted_task(detail::executor_task* task) noexcept
+        : task_(task) { }
+      posted_task(posted_task&& right) noexcept
+        : task_(std::exchange(right.task_, nullptr)) { }
+      posted_task& operator= (posted_task&&) = delete;
+      ~posted_task()
+      {
+        if (task_)
+          task_->destroy();
+      }
+
+      void operator() ()
+      {
+        std::exchange(task_, nullptr)->run();
+      }
+    };
+
+    /// The count of messages taken from one queue per drain,
+    /// so the other queues and the scheduler aren't starved.
+    std::size_t const shard_drain_batch = 256;
+  } // namespace
+
+  shard* current_shard() noexcept
+  {
+    return current_shard_slot();
+  }
+
+  shard::shard(sharded_runtime& runtime, std::size_t index, std::size_t count)
+    : runtime_(&runtime), index_(index), count_(count),
+      inbox_(new detail::shard_queue[count]), draining_(false) { }
+
+  shard::~shard()
+  {
+    for (std::size_t i = 0; i < count_; ++i)
+      while (auto task = inbox_[i].pop())
+        task->destroy();
+  }
+
+  void shard::submit(detail::executor_task* task)
+  {
+    auto const source = current_shard();
+    if (source && (source->runtime_ == runtime_) &&
+        inbox_[source->index_].push(task))
+    {
+      arm();
+      return;
+    }
+
+    // Foreign threads and overflowing queues use the scheduler,
+    // which requires copyable handlers.
+    auto posted = std::make_shared<posted_task>(task);
+    scheduler_.post([posted] { (*posted)(); });
+  }
+
+  void shard::arm()
+  {
+    // One drain is posted per batch of messages
+    if (!draining_.exchange(true, std::memory_order_acq_rel))
+      scheduler_.post([this] { drain(); });
+  }
+
+  void shard::drain()
+  {
+    // Synchronizes with the producers which armed the drain
+    draining_.exchange(false, std::memory_order_acq_rel);
+
+    bool pending = false;
+    for (std::size_t i = 0; i < count_; ++i)
+    {
+      auto& queue = inbox_[i];
+      std::size_t taken = 0;
+      while (auto task = queue.pop())
+      {
+        task->run();
+        if (++taken == shard_drain_batch)
+        {
+          pending = true;
+          break;
+        }
+      }
+    }
+    if (pending)
+      arm();
+  }
+
+  sharded_runtime::sharded_runtime(runtime_options options)
+    : options_(std::move(options))
+  {
+    if (!options_.threads)
+      options_.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    shards_.reserve(options_.threads);
+    for (std::size_t i = 0; i < options_.threads; ++i)
+      shards_.emplace_back(new shard(*this, i, options_.threads));
+  }
+
+  sharded_runtime::~sharded_runtime()
+  {
+    stop();
+    join();
+  }
+
+  void sharded_runtime::start()
+  {
+    assert(threads_.empty() &&
+           "The runtime was started already!");
+
+    for (auto& shard : shards_)
+    {
+      shard->scheduler_.restart();
+      shard->work_ = std::make_unique<executor::work>(shard->scheduler_);
+    }
+
+    threads_.reserve(shards_.size());
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+      threads_.emplace_back([this, i]
+      {
+        configure_worker_thread(options_, i);
+        current_shard_slot() = shards_[i].get();
+        run_worker(shards_[i]->scheduler_);
+        current_shard_slot() = nullptr;
+      });
+  }
+
+  void sharded_runtime::stop()
+  {
+    for (auto& shard : shards_)
+    {
+      shard->work_.reset();
+      shard->scheduler_.stop();
+    }
+  }
+
+  void sharded_runtime::join()
+  {
+    for (auto& thread : threads_)
+      thread.join();
+    threads_.clear();
+  }
+
+  execution_context*& current_execution_context()
+  {
+    static thread_local execution_context* instance = nullptr;
+    return instance;
+  }
+
+  void execution_context::weak_enter()
+  {
+    assert(!current_execution_context() &&
+           "Context already in use!");
+    current_execution_context() = this;
+  }
+
+  void execution_context::resume(shared_execution_context context)
+  {
+    // Contexts may be resumed directly from inside another context
+    auto const outer = std::exchange(current_execution_context(), nullptr);
+
+    auto const thread = current_thread_token();
+    if (auto const last = context->last_thread_)
+    {
+      auto& counters = current_resume_counters();
+      counters.resumes.fetch_add(1, std::memory_order_relaxed);
+      if (last != thread)
+        counters.migrations.fetch_add(1, std::memory_order_relaxed);
+    }
+    context->last_thread_ = thread;
+    context->home_worker_ = current_home_worker(context->scheduler());
+
+    // Every resumption starts with a fresh budget
+    context->ready_awaits_ = 0;
+    if (budget_run_time.load(std::memory_order_relaxed))
+      context->resumed_at_ = std::chrono::steady_clock::now();
+
+    context->weak_enter();
+    (*context->push_)();
+    context->weak_leave();
+
+    current_execution_context() = outer;
+
+    // Hand the reference over to the suspension handler,
+    // otherwise the context finished and is released here.
+    if (auto on_suspend = context->on_suspend_)
+    {
+      context->on_suspend_ = nullptr;
+      on_suspend(context->on_suspend_data_, std::move(context));
+    }
+    else
+    {
+      context->push_ = boost::none;
+      // Finished contexts may be kept alive by a join_handle, the stack
+      // of contexts on the heap is returned to the pool right away.
+      if (!context->embedded_)
+      {
+        recycle_stack(context->stack_);
+        context->reserved_ = 0;
+      }
+    }
+  }
+
+  void execution_context::schedule(shared_execution_context context)
+  {
+    // Contexts of a shard never leave its thread
+    if (auto const owner = context->shard_)
+    {
+      if (owner->stopped())
+        return;
+
+      owner->post([context = std::move(context)] () mutable
+      {
+        assert(context &&
+               "Execution context is invalid!");
+        resume(std::move(context));
+      });
+      return;
+    }
+
+    // Resumptions return to the executor the context was spawned on
+    auto& scheduler = context->scheduler();
+
+    // Don't dispatch the continuation
+    // when the executor was stopped
+    if (scheduler.stopped())
+      return;
+
+    auto const level = context->priority_;
+    if (level == priority::low)
+    {
+      auto& queue = context->queue();
+      detail::enqueue_prioritized(queue, level,
+        new detail::executor_task_impl<resumer>(resumer{ std::move(context) }));
+      return;
+    }
+
+    auto& depth = current_resume_depth();
+    if ((resume_policy.load(std::memory_order_relaxed) == resume_mode::dispatch)
+        && (depth < resume_max_depth.load(std::memory_order_relaxed)))
+    {
+      // Resumes the context in place when invoked from a thread
+      // of the scheduler, the depth bounds the nested resumptions.
+      scheduler.dispatch([context = std::move(context)] () mutable
+      {
+        assert(context &&
+               "Execution context is invalid!");
+        auto& depth = current_resume_depth();
+        ++depth;
+        resume(std::move(context));
+        --depth;
+      });
+    }
+    else if (level == priority::high)
+    {
+      auto& queue = context->queue();
+      detail::enqueue_prioritized(queue, level,
+        new detail::executor_task_impl<resumer>(resumer{ std::move(context) }));
+    }
+    else
+    {
+      // The resumption returns to the worker which holds the stack
+      // and working set of the context in its caches.
+      auto const home = resume_affinity.load(std::memory_order_relaxed) ?
+        context->home_worker_ : 0;
+      auto& queue = context->queue();
+      post_to_home_worker(scheduler, home, queued_resumer{
+        std::move(context), &queue, queue_clock::now() });
+    }
+  }
+
+  void execution_context::resume_or_schedule(shared_execution_context context)
+  {
+    // Contexts don't migrate to threads of other executors or shards
+    auto const owner = context->shard_;
+    if (owner ? (current_shard() == owner) :
+        runs_executor(context->scheduler()))
+      resume(std::move(context));
+    else
+      schedule(std::move(context));
+  }
+
+  void execution_context::defer(shared_execution_context context)
+  {
+    if (auto const owner = context->shard_)
+    {
+      if (owner->stopped())
+        return;
+
+      owner->post(resumer{ std::move(context) });
+      return;
+    }
+
+    auto& scheduler = context->scheduler();
+    if (scheduler.stopped())
+      return;
+
+    auto const level = context->priority_;
+    auto& queue = context->queue();
+    if (level != priority::normal)
+    {
+      detail::enqueue_prioritized(queue, level,
+        new detail::executor_task_impl<resumer>(resumer{ std::move(context) }));
+      return;
+    }
+
+    post_behind_pending_work(scheduler, queued_resumer{
+      std::move(context), &queue, queue_clock::now() });
+  }
+
+  execution_context::admission execution_context::admit()
+  {
+    // Without a limit the live contexts aren't counted
+    if (!admission_limit.load(std::memory_order_relaxed))
+      return admission(false);
+
+    if (!try_admit())
+    {
+      if (admission_mode.load(std::memory_order_relaxed) ==
+          admission_policy::fail)
+      {
+        admission_rejected.fetch_add(1, std::memory_order_relaxed);
+        throw admission_error();
+      }
+
+      // Waiters are queued under the lock after they were counted,
+      // so either a release sees the waiter or the waiter sees the slot.
+      auto& queue = current_admission_queue();
+      admission_waiter waiter{ nullptr, false, nullptr };
+      if (auto const current = current_execution_context())
+      {
+        admission_awaited.fetch_add(1, std::memory_order_relaxed);
+        auto on_suspend = [&](shared_execution_context context)
+        {
+          {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            admission_waiting.fetch_add(1, std::memory_order_seq_cst);
+            if (!try_admit())
+            {
+              waiter.context = std::move(context);
+              queue.push_back(&waiter);
+              return;
+            }
+            admission_waiting.fetch_sub(1, std::memory_order_seq_cst);
+          }
+          schedule(std::move(context));
+        };
+        current->suspend(on_suspend);
+      }
+      else
+      {
+        admission_blocked.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        admission_waiting.fetch_add(1, std::memory_order_seq_cst);
+        if (try_admit())
+          admission_waiting.fetch_sub(1, std::memory_order_seq_cst);
+        else
+        {
+          queue.push_back(&waiter);
+          queue.condition.wait(lock, [&] { return waiter.admitted; });
+        }
+      }
+    }
+    return admission(true);
+  }
+
+  void execution_context::release_admission() noexcept
+  {
+    admission_live.fetch_sub(1, std::memory_order_seq_cst);
+    if (admission_waiting.load(std::memory_order_seq_cst))
+      admit_waiters();
+  }
+
+  bool execution_context::consume_budget() noexcept
+  {
+    auto const ready_awaits =
+      budget_ready_awaits.load(std::memory_order_relaxed);
+    auto const run_time = budget_run_time.load(std::memory_order_relaxed);
+
+    bool const exhausted =
+      (ready_awaits && (++ready_awaits_ > ready_awaits)) ||
+      (run_time && (std::chrono::steady_clock::now() - resumed_at_ >=
+                    std::chrono::microseconds(run_time)));
+    if (exhausted)
+      current_resume_counters().preemptions.fetch_add(
+        1, std::memory_order_relaxed);
+    return exhausted;
+  }
+
+  void yield()
+  {
+    auto const context = current_execution_context();
+    if (!context)
+    {
+      std::this_thread::yield();
+      return;
+    }
+
+    auto on_suspend = [](shared_execution_context context)
+    {
+      execution_context::defer(std::move(context));
+    };
+    context->suspend(on_suspend);
+  }
+
+  executor& execution_context::scheduler() const noexcept
+  {
+  #ifndef AWAITIFY_NO_SYSTEM_SCHEDULER
+    if (!scheduler_)
+      return system_scheduler();
+  #endif // AWAITIFY_NO_SYSTEM_SCHEDULER
+    assert(scheduler_ &&
+           "The context isn't bound to an executor!");
+    return *scheduler_;
+  }
+
+  void execution_context::bind(executor& scheduler)
+  {
+    scheduler_ = &scheduler;
+    // Nested contexts share the queue of their parent,
+    // which saves the lookup of the queue.
+    auto const parent = current_execution_context();
+    queue_ = (parent && (parent->scheduler_ == &scheduler)) ?
+      parent->queue_ : &detail::scheduler_queue_of(scheduler);
+  }
+
+  void execution_context::start(shared_execution_context context)
+  {
+    auto const self = context.get();
+    assert(self->task_ && !self->push_ &&
+           "The context has no task or was started already!");
+
+    // The coroutine runs below the context and its inline task,
+    // the stack stays owned by the context.
+    if (!self->stack_.sp)
+      self->stack_ = acquire_stack();
+    pooled_stack_allocator allocator(self->stack_, self->reserved_);
+
+    // The context is kept alive by the reference of its resumer,
+    // so the coroutine doesn't need to own it.
+    self->push_ = coro_t::push_type(std::move(allocator),
+      [self] (coro_t::pull_type& pull)
+    {
+      self->pull_ = &pull;
+      auto const task = std::exchange(self->task_, nullptr);
+      self->task_invoker_(self, task, true);
+    });
+    resume(std::move(context));
+  }
+
+  void* execution_context::allocate_task(std::size_t size, bool is_inline)
+  {
+    if (!is_inline)
+      return detail::allocate_recycled(size);
+
+    // Inline tasks are placed below the context
+    if (!stack_.sp)
+      stack_ = acquire_stack();
+    reserved_ += reserve(size);
+    return static_cast<char*>(stack_.sp) - reserved_;
+  }
+
+  void execution_context::deallocate_task(void* task, std::size_t size,
+                                          bool is_inline) noexcept
+  {
+    // Inline tasks are released together with their stack
+    if (!is_inline)
+      detail::deallocate_recycled(task, size);
+  }
+
+  void execution_context::destroy(execution_context* context) noexcept
+  {
+    // The coroutine of a suspended context is unwound while the context
+    // is intact, its slot is released after the stack was returned.
+    context->push_ = boost::none;
+
+    auto stack = context->stack_;
+    auto const admitted = context->admitted_;
+    if (context->embedded_)
+      context->~execution_context();
+    else
+      delete context;
+
+    if (stack.sp)
+      recycle_stack(stack);
+    if (admitted)
+      release_admission();
+  }
+
+  boost::context::stack_context execution_context::acquire_stack()
+  {
+    return current_stack_pool().acquire();
+  }
+
+  void execution_context::recycle_stack(
+    boost::context::stack_context& stack) noexcept
+  {
+    current_stack_pool().recycle(stack);
+    stack = boost::context::stack_context();
+  }
+
+  void execution_context::weak_leave()
+  {
+    assert(current_execution_context() &&
+           "No context in use!");
+    current_execution_context() = nullptr;
+  }
+
+  void execution_context::suspend()
+  {
+    assert(current_execution_context() &&
+           "Invalid context of execution.");
+
+    (*pull_)();
+  }
+
+  namespace {
+    /// \brief Chase-Lev work-stealing deque
+    ///
+    /// The owning thread pushes and pops at the bottom, other threads
+    /// steal from the top. The ring grows on demand, replaced rings are
+    /// kept until the deque is destroyed since thieves may still read them.
+    class chase_lev_deque
+    {
+      class ring
+      {
+        std::int64_t const mask_;
+        std::unique_ptr<std::atomic<detail::executor_task*>[]> slots_;
+
+      public:
+        explicit ring(std::int64_t capacity)
+          : mask_(capacity - 1),
+            slots_(new std::atomic<detail::executor_task*>[capacity]) { }
+
+        std::int64_t capacity() const noexcept { return mask_ + 1; }
+
+        detail::executor_task* get(std::int64_t index) const noexcept
+        {
+          return slots_[index & mask_].load(std::memory_order_relaxed);
+        }
+        void put(std::int64_t index, detail::executor_task* task) noexcept
+        {
+          slots_[index & mask_].store(task, std::memory_order_relaxed);
+        }
+      };
+
+      std::atomic<std::int64_t> top_;
+      std::atomic<std::int64_t> bottom_;
+      std::atomic<ring*> ring_;
+      std::vector<std::unique_ptr<ring>> rings_;
+
+    public:
+      chase_lev_deque()
+        : top_(0), bottom_(0)
+      {
+        rings_.emplace_back(new ring(256));
+        ring_.store(rings_.back().get(), std::memory_order_relaxed);
+      }
+
+      bool empty() const noexcept
+      {
+        return bottom_.load(std::memory_order_relaxed) <=
+               top_.load(std::memory_order_relaxed);
+      }
+
+      void push(detail::executor_task* task)
+      {
+        auto const bottom = bottom_.load(std::memory_order_relaxed);
+        auto const top = top_.load(std::memory_order_acquire);
+        auto current = ring_.load(std::memory_order_relaxed);
+        if (bottom - top > current->capacity() - 1)
+        {
+          rings_.emplace_back(new ring(current->capacity() * 2));
+          for (auto index = top; index < bottom; ++index)
+            rings_.back()->put(index, current->get(index));
+          current = rings_.back().get();
+          ring_.store(current, std::memory_order_release);
+        }
+        current->put(bottom, task);
+        bottom_.store(bottom + 1, std::memory_order_release);
+      }
+
+      detail::executor_task* pop() noexcept
+      {
+        auto const bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        auto const current = ring_.load(std::memory_order_relaxed);
+        bottom_.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto top = top_.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+          bottom_.store(bottom + 1, std::memory_order_relaxed);
+          return nullptr;
+        }
+
+        auto task = current->get(bottom);
+        if (top == bottom)
+        {
+          // Races with thieves for the last task
+          if (!top_.compare_exchange_strong(top, top + 1,
+                                            std::memory_order_seq_cst,
+                                            std::memory_order_relaxed))
+            task = nullptr;
+          bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
+      }
+
+      /// Returns nullptr when the deque is empty or the race was lost
+      detail::executor_task* steal() noexcept
+      {
+        auto top = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto const bottom = bottom_.load(std::memory_order_acquire);
+        if (top >= bottom)
+          return nullptr;
+
+        auto const task = ring_.load(std::memory_order_acquire)->get(top);
+        if (!top_.compare_exchange_strong(top, top + 1,
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed))
+          return nullptr;
+        return task;
+      }
+    };
+
+    struct executor_thread
+    {
+      work_stealing_executor const* owner;
+      void* worker;
+    };
+
+    executor_thread& current_executor_thread()
+    {
+      static thread_local executor_thread instance{ nullptr, nullptr };
+      return instance;
+    }
+
+    /// Every n-th task is taken from the injection queue and the top
+    /// of the own deque, so LIFO scheduling can't starve older tasks.
+    std::size_t const fairness_interval = 61;
+  } // namespace
+
+  constexpr std::size_t work_stealing_executor::no_worker;
+  constexpr std::size_t work_stealing_executor::mailbox_backlog;
+
+  struct work_stealing_executor::worker
+  {
+    chase_lev_deque deque;
+    std::atomic<bool> active{false};
+    std::uint32_t random = 0;
+    std::size_t ticks = 0;
+    std::size_t index = 0;
+
+    /// Tasks which were posted to this worker
+    std::mutex mailbox_mutex;
+    detail::executor_task* mailbox_head = nullptr;
+    detail::executor_task* mailbox_tail = nullptr;
+    std::atomic<std::size_t> mailbox_size{0};
+    /// Set by parked threads which waited on the mailbox for too long
+    std::atomic<bool> starving{false};
+
+    /// Set while the worker waits for a wakeup, guarded by the mutex
+    /// of the executor. Wakers clear it so they pick distinct workers.
+    std::atomic<bool> parked{false};
+    std::condition_variable wakeup;
+    // Keeps the workers on distinct cache lines
+    char padding[64];
+  };
+
+  work_stealing_executor::work_stealing_executor(std::size_t max_threads,
+    std::chrono::steady_clock::duration starvation)
+    : capacity_(max_threads ? max_threads :
+        std::max<std::size_t>(64, std::thread::hardware_concurrency())),
+      starvation_(starvation),
+      workers_(new worker[capacity_]),
+      registered_(0), outstanding_(0), stopped_(false),
+      injection_head_(nullptr), injection_tail_(nullptr), injected_(0),
+      sleeping_(0)
+  { }
+
+  work_stealing_executor::~work_stealing_executor()
+  {
+    for (std::size_t i = 0; i < capacity_; ++i)
+      while (auto task = workers_[i].deque.pop())
+        task->destroy();
+    while (auto task = pop_injected())
+      task->destroy();
+    for (std::size_t i = 0; i < capacity_; ++i)
+      while (auto task = pop_mailbox(workers_[i]))
+        task->destroy();
+  }
+
+  bool work_stealing_executor::running_in_this_thread() const noexcept
+  {
+    return current_executor_thread().owner == this;
+  }
+
+  std::size_t work_stealing_executor::current_worker() const noexcept
+  {
+    auto const& thread = current_executor_thread();
+    if (thread.owner != this)
+      return no_worker;
+    return static_cast<worker const*>(thread.worker)->index;
+  }
+
+  std::size_t work_stealing_executor::run()
+  {
+    return run_tasks(true);
+  }
+
+  std::size_t work_stealing_executor::poll()
+  {
+    return run_tasks(false);
+  }
+
+  std::size_t work_stealing_executor::run_tasks(bool wait)
+  {
+    assert(!running_in_this_thread() &&
+           "The executor is run on this thread already!");
+
+    auto& self = acquire_worker();
+    auto& thread = current_executor_thread();
+    auto const outer = thread;
+    thread = { this, &self };
+
+    struct release_guard
+    {
+      worker& self;
+      executor_thread& thread;
+      executor_thread outer;
+
+      ~release_guard()
+      {
+        thread = outer;
+        self.active.store(false, std::memory_order_release);
+      }
+    } release{ self, thread, outer };
+
+    std::size_t count = 0;
+    while (!stopped())
+    {
+      if (auto task = next_task(self))
+      {
+        struct finish_guard
+        {
+          work_stealing_executor* executor;
+          ~finish_guard() { executor->finish(); }
+        } finish{ this };
+
+        task->run();
+        ++count;
+      }
+      else if (!wait || !park(self))
+        break;
+    }
+    return count;
+  }
+
+  void work_stealing_executor::stop()
+  {
+    stopped_.store(true, std::memory_order_seq_cst);
+    wake_all();
+  }
+
+  bool work_stealing_executor::stopped() const noexcept
+  {
+    return stopped_.load(std::memory_order_acquire);
+  }
+
+  void work_stealing_executor::restart()
+  {
+    stopped_.store(false, std::memory_order_release);
+  }
+
+  void work_stealing_executor::submit(detail::executor_task* task)
+  {
+    auto const& thread = current_executor_thread();
+    if (thread.owner != this)
+    {
+      inject(task);
+      return;
+    }
+
+    outstanding_.fetch_add(1, std::memory_order_relaxed);
+    static_cast<worker*>(thread.worker)->deque.push(task);
+    wake_one();
+  }
+
+  void work_stealing_executor::inject(detail::executor_task* task)
+  {
+    outstanding_.fetch_add(1, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(injection_mutex_);
+      if (injection_tail_)
+        injection_tail_->next = task;
+      else
+        injection_head_ = task;
+      injection_tail_ = task;
+      injected_.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake_one();
+  }
+
+  void work_stealing_executor::submit_to(std::size_t index,
+                                         detail::executor_task* task)
+  {
+    if ((index >= registered_.load(std::memory_order_acquire)) ||
+        !workers_[index].active.load(std::memory_order_relaxed))
+    {
+      submit(task);
+      return;
+    }
+
+    outstanding_.fetch_add(1, std::memory_order_relaxed);
+
+    auto& target = workers_[index];
+    std::size_t size;
+    {
+      std::lock_guard<std::mutex> lock(target.mailbox_mutex);
+      if (target.mailbox_tail)
+        target.mailbox_tail->next = task;
+      else
+        target.mailbox_head = task;
+      target.mailbox_tail = task;
+      size = target.mailbox_size.fetch_add(1, std::memory_order_seq_cst) + 1;
+    }
+
+    // Pairs with the fence of park, either the parked worker
+    // is seen here or the task is seen by the worker.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (target.parked.load(std::memory_order_relaxed) && wake(target))
+      return;
+
+    // Another thread takes over when the worker can't keep up
+    if (size > mailbox_backlog)
+      wake_one();
+  }
+
+  void work_stealing_executor::finish() noexcept
+  {
+    // Threads which ran out of work return from run()
+    if (outstanding_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      wake_all();
+  }
+
+  detail::executor_task* work_stealing_executor::next_task(worker& self)
+  {
+    if (++self.ticks % fairness_interval == 0)
+    {
+      if (auto task = pop_injected())
+        return task;
+      if (auto task = self.deque.steal())
+        return task;
+    }
+
+    // Resumptions posted to this worker precede the own deque
+    if (auto task = pop_mailbox(self))
+    {
+      if (self.starving.load(std::memory_order_relaxed))
+        self.starving.store(false, std::memory_order_relaxed);
+      return task;
+    }
+    if (auto task = self.deque.pop())
+      return task;
+    if (auto task = pop_injected())
+      return task;
+    return steal(self);
+  }
+
+  detail::executor_task* work_stealing_executor::pop_injected()
+  {
+    if (!injected_.load(std::memory_order_relaxed))
+      return nullptr;
+
+    std::lock_guard<std::mutex> lock(injection_mutex_);
+    auto const task = injection_head_;
+    if (task)
+    {
+      injection_head_ = task->next;
+      if (!injection_head_)
+        injection_tail_ = nullptr;
+      task->next = nullptr;
+      injected_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  detail::executor_task* work_stealing_executor::pop_mailbox(worker& target)
+  {
+    if (!target.mailbox_size.load(std::memory_order_relaxed))
+      return nullptr;
+
+    std::lock_guard<std::mutex> lock(target.mailbox_mutex);
+    auto const task = target.mailbox_head;
+    if (task)
+    {
+      target.mailbox_head = task->next;
+      if (!target.mailbox_head)
+        target.mailbox_tail = nullptr;
+      task->next = nullptr;
+      target.mailbox_size.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  bool work_stealing_executor::is_stealable(worker const& target)
+    const noexcept
+  {
+    auto const size = target.mailbox_size.load(std::memory_order_relaxed);
+    return size && ((size > mailbox_backlog) ||
+      target.parked.load(std::memory_order_relaxed) ||
+      target.starving.load(std::memory_order_relaxed) ||
+      !target.active.load(std::memory_order_relaxed));
+  }
+
+  void work_stealing_executor::mark_starving(worker const& self) noexcept
+  {
+    auto const count = registered_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      auto& other = workers_[i];
+      if ((&other != &self) &&
+          other.mailbox_size.load(std::memory_order_relaxed))
+        other.starving.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  bool work_stealing_executor::has_foreign_mail(worker const& self)
+    const noexcept
+  {
+    auto const count = registered_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i)
+      if ((&workers_[i] != &self) &&
+          workers_[i].mailbox_size.load(std::memory_order_relaxed))
+        return true;
+    return false;
+  }
+
+  detail::executor_task* work_stealing_executor::steal(worker& self)
+  {
+    auto const count = registered_.load(std::memory_order_acquire);
+    if (count < 2)
+      return nullptr;
+
+    // xorshift32
+    self.random ^= self.random << 13;
+    self.random ^= self.random >> 17;
+    self.random ^= self.random << 5;
+
+    auto const start = std::size_t(self.random) % count;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      auto& victim = workers_[(start + i) % count];
+      if (&victim == &self)
+        continue;
+      if (auto task = victim.deque.steal())
+        return task;
+    }
+
+    // Takes over the mailboxes of overloaded or parked workers
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      auto& victim = workers_[(start + i) % count];
+      if (&victim == &self)
+        continue;
+      if (is_stealable(victim))
+        if (auto task = pop_mailbox(victim))
+          return task;
+    }
+    return nullptr;
+  }
+
+  bool work_stealing_executor::has_pending(worker const& self) const noexcept
+  {
+    if (injected_.load(std::memory_order_relaxed) ||
+        self.mailbox_size.load(std::memory_order_relaxed))
+      return true;
+
+    auto const count = registered_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      auto const& other = workers_[i];
+      if (!other.deque.empty())
+        return true;
+      if ((&other != &self) && is_stealable(other))
+        return true;
+    }
+    return false;
+  }
+
+  bool work_stealing_executor::park(worker& self)
+  {
+    auto const polled = poll_while_idle([&]
+    {
+      return stopped() || !outstanding_.load(std::memory_order_relaxed) ||
+             has_pending(self);
+    });
+    if (polled)
+      return !stopped() && outstanding_.load(std::memory_order_acquire);
+
+    idle_parks.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_.fetch_add(1, std::memory_order_seq_cst);
+
+    bool pending;
+    bool woken = false;
+    while (true)
+    {
+      self.parked.store(true, std::memory_order_seq_cst);
+      // Pairs with the fences of wake_one and submit_to, either
+      // the sleeper is seen by the producer or the task is seen here.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (stopped() || !outstanding_.load(std::memory_order_acquire))
+      {
+        pending = false;
+        break;
+      }
+      if (has_pending(self))
+      {
+        pending = true;
+        break;
+      }
+
+      // Mailboxes which are pending are revisited after a while,
+      // since their workers may be blocked by a long running task.
+      if (!has_foreign_mail(self))
+      {
+        self.wakeup.wait(lock);
+        woken = true;
+      }
+      else if (self.wakeup.wait_for(lock, starvation_) ==
+               std::cv_status::no_timeout)
+        woken = true;
+      else
+        mark_starving(self);
+    }
+
+    self.parked.store(false, std::memory_order_relaxed);
+    sleeping_.fetch_sub(1, std::memory_order_relaxed);
+    if (pending && woken)
+      idle_wakeups.fetch_add(1, std::memory_order_relaxed);
+    return pending;
+  }
+
+  void work_stealing_executor::wake_one()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!sleeping_.load(std::memory_order_relaxed))
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const count = registered_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      auto& target = workers_[i];
+      if (target.parked.load(std::memory_order_relaxed))
+      {
+        target.parked.store(false, std::memory_order_relaxed);
+        target.wakeup.notify_one();
+        return;
+      }
+    }
+  }
+
+  void work_stealing_executor::wake_all()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const count = registered_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      workers_[i].parked.store(false, std::memory_order_relaxed);
+      workers_[i].wakeup.notify_one();
+    }
+  }
+
+  bool work_stealing_executor::wake(worker& target)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!target.parked.load(std::memory_order_relaxed))
+      return false;
+    target.parked.store(false, std::memory_order_relaxed);
+    target.wakeup.notify_one();
+    return true;
+  }
+
+  work_stealing_executor::worker& work_stealing_executor::acquire_worker()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const count = registered_.load(std::memory_order_relaxed);
+
+    // Reuses the slot of a thread which left, including its tasks
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      bool expected = false;
+      if (workers_[i].active.compare_exchange_strong(expected, true))
+        return workers_[i];
+    }
+
+    if (count == capacity_)
+      throw std::length_error("The executor is run by too many threads!");
+
+    auto& self = workers_[count];
+    self.active.store(true, std::memory_order_relaxed);
+    self.random = std::uint32_t(count * 2654435761u + 1);
+    self.index = count;
+    registered_.store(count + 1, std::memory_order_release);
+    return self;
   }
 }
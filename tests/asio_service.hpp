@@ -0,0 +1,46 @@
+//  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
+//     Distributed under the Boost Software License, Version 1.0
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef INCLUDED_AWAITIFY_TESTS_ASIO_SERVICE_HPP
+#define INCLUDED_AWAITIFY_TESTS_ASIO_SERVICE_HPP
+
+#include <memory>
+#include <thread>
+#include <boost/asio/io_service.hpp>
+
+#include "awaitify/awaitify.hpp"
+
+/// Returns the io_service which runs the asio operations of the tests,
+/// that's the system scheduler unless another executor type is provided.
+inline boost::asio::io_service& asio_service()
+{
+#ifndef AWAITIFY_PROVIDE_EXECUTOR_TYPE
+  return awf::system_scheduler();
+#else
+  // The completions resume the contexts on their own executor
+  struct runner
+  {
+    boost::asio::io_service service;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::thread thread;
+
+    runner()
+      : work(new boost::asio::io_service::work(service)),
+        thread([this] { service.run(); }) { }
+
+    ~runner()
+    {
+      work.reset();
+      service.stop();
+      thread.join();
+    }
+  };
+
+  static runner instance;
+  return instance.service;
+#endif // AWAITIFY_PROVIDE_EXECUTOR_TYPE
+}
+
+#endif // INCLUDED_AWAITIFY_TESTS_ASIO_SERVICE_HPP
@@ -0,0 +1,754 @@
+//  Copyright 2015-2016 Denis Blank <denis.blank at outlook dot com>
+//     Distributed under the Boost Software License, Version 1.0
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+// The benchmarks are hidden from the default test run,
+// invoke them through `awaitify_tests [benchmark]`.
+
+#include "awaitify/awaitify.hpp"
+#include "awaitify/use_await.hpp"
+
+#include <deque>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include "catch/catch.hpp"
+
+#include "asio_service.hpp"
+
+using namespace awf;
+
+namespace {
+  template<typename T>
+  void report(char const* name, std::size_t count, T&& duration)
+  {
+    auto const ns = std::chrono::duration_cast<
+      std::chrono::nanoseconds>(duration).count();
+    std::cout << name << ": " << count << " ops in "
+              << (ns / 1000000.0) << " ms ("
+              << (count * 1000000000.0 / (ns ? ns : 1)) << " ops/s)"
+              << std::endl;
+  }
+
+  template<typename T>
+  void measure(char const* name, std::size_t count, T&& body)
+  {
+    auto const begin = std::chrono::steady_clock::now();
+    body();
+    report(name, count, std::chrono::steady_clock::now() - begin);
+  }
+} // namespace
+
+TEST_CASE("Spawn throughput", "[.][benchmark]")
+{
+  std::size_t const count = 100000;
+  auto const options = stack_pool_configuration();
+
+  auto spawn_futures = [&]
+  {
+    std::vector<future_t<std::size_t>> futures;
+    futures.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+      futures.push_back(awaitify([i] { return i; }));
+    for (auto& future : futures)
+      future.get();
+  };
+
+  configure_stack_pool({ options.stack_size, 0 });
+  measure("spawn without stack pool", count, spawn_futures);
+
+  configure_stack_pool(options);
+  measure("spawn with stack pool", count, spawn_futures);
+
+  // Captures beyond AWAITIFY_TASK_BUFFER_SIZE are stored on the heap
+  measure("spawn with oversized captures", count, [&]
+  {
+    std::array<char, AWAITIFY_TASK_BUFFER_SIZE + 1> payload{};
+    std::vector<future_t<std::size_t>> futures;
+    futures.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+      futures.push_back(awaitify([i, payload] { return i + payload[0]; }));
+    for (auto& future : futures)
+      future.get();
+  });
+
+  measure("spawn with in-place results", count, [&]
+  {
+    std::vector<join_handle<std::size_t>> handles;
+    handles.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+      handles.push_back(spawn([i] { return i; }));
+    for (auto& handle : handles)
+      handle.get();
+  });
+
+  // The context, its result and its task share one pooled stack
+  measure("spawn and join with a warm pool", count, [&]
+  {
+    for (std::size_t i = 0; i < count; ++i)
+      spawn([i] { return i; }).get();
+  });
+
+  // Detached contexts count their completions down instead of a future
+  measure("detached spawn with stack pool", count, [&]
+  {
+    std::atomic<std::size_t> pending(count);
+    promise_t<void> done;
+    auto completion = done.get_future();
+    for (std::size_t i = 0; i < count; ++i)
+      spawn_detached([&]
+      {
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          done.set_value();
+      });
+    completion.get();
+  });
+}
+
+namespace {
+  template<template<typename> class Promise>
+  void benchmark_futures(char const* ready_name,
+                         char const* suspend_name,
+                         char const* cross_thread_name)
+  {
+    std::size_t const count = 100000;
+
+    measure(ready_name, count, [&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        Promise<std::size_t> promise;
+        promise.set_value(i);
+        promise.get_future().get();
+      }
+    });
+
+    measure(suspend_name, count / 10, [&]
+    {
+      for (std::size_t i = 0; i < count / 10; ++i)
+      {
+        Promise<std::size_t> promise;
+        auto future = promise.get_future().then([](auto future)
+        {
+          return future.get();
+        });
+        promise.set_value(i);
+        future.get();
+      }
+    });
+
+    std::vector<Promise<std::size_t>> promises(count);
+    std::vector<decltype(promises.front().get_future())> futures;
+    futures.reserve(count);
+    for (auto& promise : promises)
+      futures.push_back(promise.get_future());
+
+    measure(cross_thread_name, count, [&]
+    {
+      std::thread producer([&]
+      {
+        for (std::size_t i = 0; i < count; ++i)
+          promises[i].set_value(i);
+      });
+      for (auto& future : futures)
+        future.get();
+      producer.join();
+    });
+  }
+} // namespace
+
+TEST_CASE("Future and promise overhead", "[.][benchmark]")
+{
+  benchmark_futures<awf::promise>("awf::future ready",
+                                  "awf::future suspend",
+                                  "awf::future cross thread");
+  benchmark_futures<boost::promise>("boost::future ready",
+                                    "boost::future suspend",
+                                    "boost::future cross thread");
+}
+
+TEST_CASE("Await round trip", "[.][benchmark]")
+{
+  std::size_t const count = 100000;
+  auto const options = resume_configuration();
+
+  auto round_trip = [&]
+  {
+    awaitify([&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        auto promise = std::make_shared<promise_t<std::size_t>>();
+        auto future = promise->get_future();
+        system_scheduler().post([promise, i]
+        {
+          promise->set_value(i);
+        });
+        await std::move(future);
+      }
+    }).get();
+  };
+
+  configure_resume({ resume_mode::post, options.max_depth });
+  measure("await round trip (post)", count, round_trip);
+
+  configure_resume({ resume_mode::dispatch, options.max_depth });
+  measure("await round trip (dispatch)", count, round_trip);
+
+  configure_resume(options);
+}
+
+TEST_CASE("Fan-out await", "[.][benchmark]")
+{
+  std::size_t const count = 10000;
+  std::size_t const fan_out = 16;
+
+  auto spawn_requests = []
+  {
+    std::vector<future_t<std::size_t>> futures;
+    for (std::size_t i = 0; i < fan_out; ++i)
+    {
+      auto promise = std::make_shared<promise_t<std::size_t>>();
+      futures.push_back(promise->get_future());
+      system_scheduler().post([promise, i]
+      {
+        promise->set_value(i);
+      });
+    }
+    return futures;
+  };
+
+  measure("fan-out sequential await", count, [&]
+  {
+    awaitify([&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        for (auto& future : spawn_requests())
+          await std::move(future);
+    }).get();
+  });
+
+  measure("fan-out await_all", count, [&]
+  {
+    awaitify([&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        await_all(spawn_requests());
+    }).get();
+  });
+}
+
+TEST_CASE("Outstanding timers", "[.][benchmark]")
+{
+  using clock = std::chrono::steady_clock;
+  std::size_t const count = 1000000;
+
+  auto deadline = [](std::size_t i)
+  {
+    // Spread over the first levels of the wheel
+    return clock::now() + std::chrono::seconds(10) +
+      std::chrono::milliseconds(i % 100000);
+  };
+
+  {
+    std::deque<detail::timer_entry> entries;
+    for (std::size_t i = 0; i < count; ++i)
+      entries.emplace_back([](void*, bool) { }, nullptr);
+
+    measure("timer wheel insert", count, [&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        detail::schedule_timer(entries[i], deadline(i));
+    });
+    measure("timer wheel cancel", count, [&]
+    {
+      for (auto& entry : entries)
+        detail::cancel_timer(entry);
+    });
+  }
+
+  {
+    std::deque<boost::asio::steady_timer> timers;
+    measure("asio steady_timer insert", count, [&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        timers.emplace_back(asio_service(), deadline(i));
+        timers.back().async_wait([](boost::system::error_code const&) { });
+      }
+    });
+    measure("asio steady_timer cancel", count, [&]
+    {
+      for (auto& timer : timers)
+        timer.cancel();
+    });
+  }
+
+  {
+    struct counter
+    {
+      std::size_t total;
+      std::atomic<std::size_t> expired;
+      std::shared_ptr<boost::promise<void>> done;
+    } expiry{ count, { 0 }, std::make_shared<boost::promise<void>>() };
+
+    std::deque<detail::timer_entry> entries;
+    for (std::size_t i = 0; i < count; ++i)
+      entries.emplace_back([](void* data, bool)
+      {
+        auto& expiry = *static_cast<counter*>(data);
+        if (++expiry.expired == expiry.total)
+        {
+          // The counter is released once the promise was set
+          auto done = expiry.done;
+          done->set_value();
+        }
+      }, &expiry);
+
+    auto const begin = clock::now();
+    for (std::size_t i = 0; i < count; ++i)
+      detail::schedule_timer(entries[i],
+        begin + std::chrono::milliseconds(i % 100));
+    expiry.done->get_future().get();
+    report("timer wheel expiry", count, clock::now() - begin);
+  }
+}
+
+TEST_CASE("Asio await", "[.][benchmark]")
+{
+  using socket_t = boost::asio::local::stream_protocol::socket;
+  std::size_t const count = 100000;
+
+  auto ping_pong = [&](auto&& write, auto&& read)
+  {
+    awaitify([&]
+    {
+      socket_t left(asio_service()), right(asio_service());
+      boost::asio::local::connect_pair(left, right);
+
+      char message = 0;
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        write(left, boost::asio::buffer(&message, 1));
+        read(right, boost::asio::buffer(&message, 1));
+      }
+    }).get();
+  };
+
+  // Wraps the handler into a promise and awaits its future
+  auto through_future = [](auto initiate)
+  {
+    return [initiate](socket_t& socket, auto buffer)
+    {
+      auto promise = std::make_shared<promise_t<std::size_t>>();
+      auto future = promise->get_future();
+      initiate(socket, buffer,
+        [promise](boost::system::error_code const&, std::size_t size)
+      {
+        promise->set_value(size);
+      });
+      return await std::move(future);
+    };
+  };
+
+  measure("asio promise/future round trip", count, [&]
+  {
+    ping_pong(through_future([](socket_t& socket, auto buffer, auto handler)
+    {
+      boost::asio::async_write(socket, buffer, std::move(handler));
+    }), through_future([](socket_t& socket, auto buffer, auto handler)
+    {
+      boost::asio::async_read(socket, buffer, std::move(handler));
+    }));
+  });
+
+  measure("asio use_await round trip", count, [&]
+  {
+    ping_pong([](socket_t& socket, auto buffer)
+    {
+      return boost::asio::async_write(socket, buffer, use_await);
+    }, [](socket_t& socket, auto buffer)
+    {
+      return boost::asio::async_read(socket, buffer, use_await);
+    });
+  });
+}
+
+namespace {
+  /// Posts a tree of tasks with the given fan-out from inside the tasks
+  /// and runs the executor on the given count of threads.
+  template<typename Executor>
+  void run_spawn_tree(std::size_t thread_count, std::size_t depth)
+  {
+    Executor executor;
+    std::function<void(std::size_t)> spawn = [&](std::size_t level)
+    {
+      if (level)
+        for (int i = 0; i < 8; ++i)
+          executor.post([&spawn, level] { spawn(level - 1); });
+    };
+    executor.post([&] { spawn(depth); });
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < thread_count; ++i)
+      threads.emplace_back([&] { executor.run(); });
+    for (auto& thread : threads)
+      thread.join();
+  }
+} // namespace
+
+TEST_CASE("Executor scaling", "[.][benchmark]")
+{
+  std::size_t const depth = 6;
+  // 8^0 + 8^1 + ... + 8^6
+  std::size_t const count = 299593;
+
+  for (std::size_t threads = 1; threads <= 64; threads *= 2)
+  {
+    std::cout << threads << " threads" << std::endl;
+    measure("  io_service spawn tree", count, [&]
+    {
+      run_spawn_tree<boost::asio::io_service>(threads, depth);
+    });
+    measure("  work_stealing_executor spawn tree", count, [&]
+    {
+      run_spawn_tree<work_stealing_executor>(threads, depth);
+    });
+  }
+}
+
+TEST_CASE("Resume affinity", "[.][benchmark]")
+{
+  std::size_t const contexts = 64;
+  std::size_t const rounds = 1000;
+  auto const options = resume_configuration();
+
+  // Contexts await promises which are completed by posted handlers
+  auto await_posted = [&]
+  {
+    std::vector<future_t<void>> futures;
+    for (std::size_t i = 0; i < contexts; ++i)
+      futures.push_back(awaitify([&]
+      {
+        for (std::size_t round = 0; round < rounds; ++round)
+        {
+          auto promise = std::make_shared<promise_t<void>>();
+          auto future = promise->get_future();
+          system_scheduler().post([promise] { promise->set_value(); });
+          await std::move(future);
+        }
+      }));
+    for (auto& future : futures)
+      future.get();
+  };
+
+  for (bool affinity : { false, true })
+  {
+    configure_resume({ resume_mode::post, options.max_depth, affinity });
+    auto const before = resume_statistics();
+    auto const begin = std::chrono::steady_clock::now();
+    measure(affinity ? "await with affinity" : "await without affinity",
+            contexts * rounds, await_posted);
+    auto const seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+    auto const after = resume_statistics();
+
+    std::cout << "  " << (after.migrations - before.migrations)
+              << " of " << (after.resumes - before.resumes)
+              << " resumptions migrated ("
+              << ((after.migrations - before.migrations) / seconds)
+              << " migrations/s)" << std::endl;
+  }
+
+  configure_resume(options);
+}
+
+TEST_CASE("Priority queue wait", "[.][benchmark]")
+{
+  std::size_t const batch_contexts = 2000;
+  std::size_t const probes = 100;
+
+  // Latency probes compete with batch contexts which await repeatedly
+  auto probe_under_load = [&](priority level)
+  {
+    auto const before = priority_statistics(level);
+    std::atomic<bool> done(false);
+    std::vector<future_t<void>> batch;
+    for (std::size_t i = 0; i < batch_contexts; ++i)
+      batch.push_back(awaitify(priority::normal, [&]
+      {
+        while (!done)
+          await awaitify([] { });
+      }));
+
+    measure(level == priority::high ? "  high priority probes" :
+                                      "  normal priority probes",
+            probes, [&]
+    {
+      for (std::size_t i = 0; i < probes; ++i)
+        awaitify(level, [] { await awaitify([] { }); }).get();
+    });
+
+    done = true;
+    for (auto& future : batch)
+      future.get();
+
+    auto const after = priority_statistics(level);
+    auto const dequeued = after.dequeued - before.dequeued;
+    std::cout << "  mean queue wait "
+              << ((after.total_wait - before.total_wait).count() /
+                  (dequeued ? dequeued : 1) / 1000.0) << " us, max "
+              << (after.max_wait.count() / 1000.0) << " us" << std::endl;
+  };
+
+  std::cout << batch_contexts << " batch contexts" << std::endl;
+  probe_under_load(priority::normal);
+  probe_under_load(priority::high);
+}
+
+TEST_CASE("Run budgets", "[.][benchmark]")
+{
+  std::size_t const threads = 2;
+  std::size_t const probes = 100;
+  auto const options = budget_configuration();
+
+  executor scheduler;
+  runtime workers(scheduler, { threads, false, "awf-budget" });
+  workers.start();
+
+  // Probes compete with a context per thread which only awaits
+  // ready futures, the contexts give up after a deadline, otherwise
+  // probes without run budgets would never get a thread.
+  auto probe_under_load = [&](char const* name)
+  {
+    auto const deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    std::atomic<bool> done(false);
+    std::vector<future_t<void>> hogs;
+    for (std::size_t i = 0; i < threads; ++i)
+      hogs.push_back(awaitify(scheduler, [&]
+      {
+        while (!done && (std::chrono::steady_clock::now() < deadline))
+          await make_ready_future();
+      }));
+
+    std::chrono::steady_clock::duration max(0);
+    measure(name, probes, [&]
+    {
+      for (std::size_t i = 0; i < probes; ++i)
+      {
+        auto const begin = std::chrono::steady_clock::now();
+        awaitify(scheduler, [] { }).get();
+        max = std::max(max, std::chrono::steady_clock::now() - begin);
+      }
+    });
+
+    done = true;
+    for (auto& future : hogs)
+      future.get();
+
+    std::cout << "  max probe latency " << (std::chrono::duration_cast<
+      std::chrono::microseconds>(max).count()) << " us" << std::endl;
+  };
+
+  auto const before = resume_statistics();
+  configure_budget({ 1024, std::chrono::microseconds(1000) });
+  probe_under_load("probes with run budgets");
+  std::cout << "  " << (resume_statistics().preemptions - before.preemptions)
+            << " preemptions" << std::endl;
+
+  configure_budget({ 0, std::chrono::microseconds(0) });
+  probe_under_load("probes without run budgets");
+  configure_budget(options);
+
+  workers.stop();
+  workers.join();
+}
+
+TEST_CASE("Spawn bursts", "[.][benchmark]")
+{
+  std::size_t const count = 100000;
+  auto const options = admission_configuration();
+
+  // The contexts don't spawn children, parents could hold all slots
+  // while they wait for the admission of their children.
+  auto burst = [&](char const* name)
+  {
+    auto const before = admission_statistics();
+    std::size_t max_live = 0;
+    std::vector<future_t<void>> futures;
+    futures.reserve(count);
+    measure(name, count, [&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        futures.push_back(awaitify([] { yield(); }));
+        max_live = std::max(max_live, admission_statistics().live);
+      }
+      for (auto& future : futures)
+        future.get();
+    });
+
+    auto const after = admission_statistics();
+    // Live contexts are only counted while a limit is configured
+    std::cout << "  ";
+    if (admission_configuration().max_contexts)
+      std::cout << max_live << " live contexts at most, ";
+    std::cout << (after.blocked - before.blocked) << " blocked spawns"
+              << std::endl;
+  };
+
+  configure_admission({ 0, admission_policy::wait });
+  burst("unbounded burst");
+  configure_admission({ 256, admission_policy::wait });
+  burst("burst limited to 256 live contexts");
+
+  configure_admission(options);
+}
+
+TEST_CASE("Isolated executors", "[.][benchmark]")
+{
+  std::size_t const count = 10000;
+
+  // Awaits round trips while batch contexts keep the batch executor busy
+  auto round_trip_under_load = [&](executor& latency, executor& batch)
+  {
+    std::atomic<bool> done(false);
+    std::vector<future_t<void>> load;
+    for (int i = 0; i < 4; ++i)
+      load.push_back(awaitify(batch, [&]
+      {
+        while (!done)
+          await awaitify([] { });
+      }));
+
+    measure("  await round trip", count, [&]
+    {
+      awaitify(latency, [&]
+      {
+        for (std::size_t i = 0; i < count; ++i)
+          await awaitify([] { });
+      }).get();
+    });
+
+    done = true;
+    for (auto& future : load)
+      future.get();
+  };
+
+  std::cout << "shared executor" << std::endl;
+  round_trip_under_load(system_scheduler(), system_scheduler());
+
+  executor latency;
+  runtime latency_workers(latency, { 1, false, "awf-latency" });
+  latency_workers.start();
+  std::cout << "isolated executor" << std::endl;
+  round_trip_under_load(latency, system_scheduler());
+}
+
+TEST_CASE("Cross-shard calls", "[.][benchmark]")
+{
+  std::size_t const count = 100000;
+
+  measure("system scheduler await awaitify", count, [&]
+  {
+    awaitify([&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        await awaitify([] { return 1; });
+    }).get();
+  });
+
+  sharded_runtime shards({ 2 });
+  shards.start();
+  measure("same shard await awaitify", count, [&]
+  {
+    awaitify(shards[0], [&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        await awaitify(shards[0], [] { return 1; });
+    }).get();
+  });
+  measure("cross-shard await awaitify", count, [&]
+  {
+    awaitify(shards[0], [&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        await awaitify(shards[1], [] { return 1; });
+    }).get();
+  });
+  shards.stop();
+  shards.join();
+}
+
+TEST_CASE("Wakeup latency", "[.][benchmark]")
+{
+  std::size_t const count = 10000;
+  auto const options = idle_configuration();
+
+  // Contexts await promises which are completed by a foreign thread
+  auto cross_thread = [&]
+  {
+    std::atomic<promise_t<std::size_t>*> slot(nullptr);
+    std::atomic<bool> done(false);
+    std::thread producer([&]
+    {
+      while (!done)
+      {
+        if (auto promise = slot.exchange(nullptr))
+          promise->set_value(0);
+        else
+          std::this_thread::yield();
+      }
+    });
+
+    awaitify([&]
+    {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        auto promise = std::make_shared<promise_t<std::size_t>>();
+        auto future = promise->get_future();
+        slot = promise.get();
+        await std::move(future);
+        // The producer may still be inside set_value
+        while (slot.load())
+          std::this_thread::yield();
+      }
+    }).get();
+
+    done = true;
+    producer.join();
+  };
+
+  auto const before = idle_statistics();
+  configure_idle({ std::chrono::microseconds(0),
+                   std::chrono::microseconds(0) });
+  measure("wakeup after parking", count, cross_thread);
+
+  auto const parked = idle_statistics();
+  configure_idle({ std::chrono::microseconds(50),
+                   std::chrono::microseconds(50) });
+  measure("wakeup while spinning", count, cross_thread);
+  auto const spinning = idle_statistics();
+
+  std::cout << "parking: " << (parked.parks - before.parks) << " parks, "
+            << (parked.wakeups - before.wakeups) << " wakeups" << std::endl
+            << "spinning: " << (spinning.spins - parked.spins) << " spins, "
+            << (spinning.yields - parked.yields) << " yields, "
+            << (spinning.parks - parked.parks) << " parks, "
+            << (spinning.wakeups - parked.wakeups) << " wakeups" << std::endl;
+
+  configure_idle(options);
+}
@@ -5,11 +5,26 @@
 //             http://www.boost.org/LICENSE_1_0.txt)
 
 #include "awaitify/awaitify.hpp"
+#include "awaitify/use_await.hpp"
 
+#include "asio_service.hpp"
+
+#include <mutex>
 #include <atomic>
 #include <thread>
+#include <future>
+#include <string>
+#include <vector>
+#include <array>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
+#ifdef __linux__
+  #include <pthread.h>
+#endif // __linux__
 
 #define CATCH_CONFIG_RUNNER
 #include "catch/catch.hpp"
@@ -18,7 +33,12 @@
 
 using namespace awf;
 
-static std::unique_ptr<boost::asio::io_service::work> work;
+/// The count of the workers of the system scheduler
+#ifdef MULTITHREADED
+std::size_t const system_workers = 5;
+#else
+std::size_t const system_workers = 1;
+#endif // MULTITHREADED
 
 template<typename T>
 auto invoke(std::true_type /*void*/, T&& task)
@@ -45,6 +65,10 @@ auto invoke(std::false_type /*non void*/, T&& task)
   return promise->get_future();
 }
 
+// Called through a volatile pointer, so the compiler can't reuse
+// the id of the thread across the suspension of a context.
+std::thread::id (* volatile current_thread_id)() = &std::this_thread::get_id;
+
 template<typename T>
 auto invoke(T&& task)
 {
@@ -55,31 +79,14 @@ auto invoke(T&& task)
 
 int main(int argc, char** argv)
 {
-  // Initialize work
-  work = std::make_unique<boost::asio::io_service::work>(system_scheduler());
-
-  auto result = boost::async([=]
-  {
-    return Catch::Session().run(argc, argv);
-  });
-
-#ifdef MULTITHREADED
-  boost::thread_group threads;
-  for (auto i : { 1, 2, 3, 4 })
-  {
-    (void)i;
-    threads.create_thread(
-      boost::bind(&boost::asio::io_service::run, &system_scheduler()));
-  }
-#endif // MULTITHREADED
+  runtime workers({ system_workers });
+  workers.start();
 
-  system_scheduler().run();
-  
-#ifdef MULTITHREADED
-  threads.join_all();
-#endif // MULTITHREADED
+  int value = Catch::Session().run(argc, argv);
 
-  int value = result.get();
+  // Stop the executor
+  workers.stop();
+  workers.join();
 
   // Attach breakpoint here ,-)
   return value;
@@ -113,6 +120,121 @@ TEST_CASE("Basic future_t and promise_t tests", "[future_t & promise_t]")
   }
 }
 
+TEST_CASE("Native future and promise tests", "[future & promise]")
+{
+  SECTION("The future is available after the value was passed to the promise")
+  {
+    awf::promise<bool> promise;
+    auto future = promise.get_future();
+    REQUIRE_FALSE(future.is_ready());
+    promise.set_value(true);
+    REQUIRE(future.is_ready());
+    CHECK(future.get());
+    CHECK_FALSE(future.valid());
+  }
+
+  SECTION("Futures are chainable before and after completion")
+  {
+    awf::promise<int> promise;
+    auto future = promise.get_future().then([](awf::future<int> future)
+    {
+      return future.get() + 1;
+    }).then([](awf::future<int> future)
+    {
+      CHECK(future.get() == 101);
+    });
+    REQUIRE_FALSE(future.is_ready());
+    promise.set_value(100);
+    REQUIRE(future.is_ready());
+    future.get();
+
+    auto ready = awf::make_ready_future(std::string("ready")).then(
+      [](awf::future<std::string> future)
+    {
+      return future.get().size();
+    });
+    CHECK(ready.get() == 5);
+  }
+
+  SECTION("Futures are completable from other threads")
+  {
+    awf::promise<std::unique_ptr<int>> promise;
+    auto future = promise.get_future();
+    std::thread([promise = std::move(promise)]() mutable
+    {
+      promise.set_value(std::make_unique<int>(42));
+    }).detach();
+    CHECK(*future.get() == 42);
+  }
+
+  SECTION("Exceptions and broken promises are propagated")
+  {
+    awf::promise<void> promise;
+    auto future = promise.get_future();
+    promise.set_exception(std::make_exception_ptr(std::runtime_error("")));
+    CHECK_THROWS_AS(future.get(), std::runtime_error const&);
+
+    auto broken = awf::promise<int>().get_future();
+    CHECK_THROWS_AS(broken.get(), std::future_error const&);
+  }
+}
+
+TEST_CASE("Await continuation tests", "[continuation]")
+{
+  SECTION("boost futures resume on the completing thread")
+  {
+    promise_t<int> promise;
+    auto future = promise.get_future();
+    std::thread::id invoked;
+    detail::when_ready(future, [&](future_t<int> ready)
+    {
+      invoked = std::this_thread::get_id();
+      CHECK(ready.get() == 1);
+    });
+    std::thread::id completing;
+    std::thread([&]
+    {
+      completing = std::this_thread::get_id();
+      promise.set_value(1);
+    }).join();
+    // A continuation on a launched helper thread would differ
+    CHECK(invoked == completing);
+    CHECK(invoked != std::this_thread::get_id());
+  }
+
+  SECTION("The completion of an await costs exactly one enqueue")
+  {
+    executor scheduler;
+    executor::work work(scheduler);
+    promise_t<int> promise;
+    auto future = awaitify(scheduler,
+      [completion = promise.get_future()] () mutable
+    {
+      return await std::move(completion);
+    });
+
+    // Starts the context until it's suspended
+    CHECK(scheduler.poll() == 1);
+    std::thread([&] { promise.set_value(1); }).join();
+    CHECK(scheduler.poll() == 1);
+    CHECK(future.get() == 1);
+  }
+
+  SECTION("Native futures resume on the completing thread")
+  {
+    awf::promise<int> promise;
+    auto future = promise.get_future();
+    std::thread::id invoked;
+    detail::when_ready(future, [&](awf::future<int> ready)
+    {
+      invoked = std::this_thread::get_id();
+      CHECK(ready.get() == 1);
+    });
+    promise.set_value(1);
+    CHECK(invoked == std::this_thread::get_id());
+  }
+}
+
 TEST_CASE("Basic executor tests", "[executor]")
 {
   SECTION("The executor supports `dispatch` dispatching")
@@ -162,7 +284,7 @@ TEST_CASE("Awaitify & await tests", "[awaitify & await]")
   {
     auto future = awaitify([]
     {
-      std::atomic<bool> invoked = false;
+      std::atomic<bool> invoked(false);
       await invoke([&]
       {
         invoked = true;
@@ -204,58 +326,1668 @@ TEST_CASE("Awaitify & await tests", "[awaitify & await]")
     });
     CHECK(future.get());
   }
+
+  SECTION("Contexts are exposed as current context across suspensions")
+  {
+    CHECK_FALSE(current_execution_context());
+    auto future = awaitify([]
+    {
+      auto const context = current_execution_context();
+      await invoke([] { return true; });
+      return context && (context == current_execution_context());
+    });
+    CHECK(future.get());
+  }
 }
 
-TEST_CASE("load test", "[executor]")
+TEST_CASE("Stack pool tests", "[stack pool]")
 {
-  SECTION("load")
+  auto const options = stack_pool_configuration();
+
+  SECTION("Released stacks are reused by the same thread")
   {
-    for (int i = 0; i < 1000; ++i)
+    pooled_stack_allocator allocator;
+    auto stack = allocator.allocate();
+    auto const sp = stack.sp;
+    CHECK(stack.size == options.stack_size);
+    allocator.deallocate(stack);
+
+    auto recycled = allocator.allocate();
+    CHECK(recycled.sp == sp);
+    allocator.deallocate(recycled);
+  }
+
+  SECTION("Stacks of a different size aren't reused")
+  {
+    pooled_stack_allocator allocator;
+    auto stack = allocator.allocate();
+    allocator.deallocate(stack);
+
+    configure_stack_pool({ options.stack_size * 2, options.depth });
+    auto resized = allocator.allocate();
+    CHECK(resized.size == options.stack_size * 2);
+    allocator.deallocate(resized);
+  }
+
+  SECTION("Contexts are executable with a disabled pool")
+  {
+    configure_stack_pool({ options.stack_size, 0 });
+    auto future = awaitify([]
     {
-        /*
-        try
-        {
-          awaitify([]
-          {
-            try
-            {
+      return await invoke([] { return true; });
+    });
+    CHECK(future.get());
+  }
 
-              int res1 = await invoke([] { return 0; });
-            }
-            catch(std::exception const& e)
-            {
-              auto msg = e.what();
+  configure_stack_pool(options);
+}
 
-              int iiiiii = 0;
-            }
-            // int res2 = await invoke([] { return 0; });
-          });
-        }
-        catch(std::exception const& e)
-        {
-          auto msg = e.what();
+TEST_CASE("Context recycling tests", "[recycling]")
+{
+  SECTION("Released blocks are reused by the same thread")
+  {
+    auto block = detail::allocate_recycled(128);
+    detail::deallocate_recycled(block, 128);
+    auto recycled = detail::allocate_recycled(128);
+    CHECK(recycled == block);
+    detail::deallocate_recycled(recycled, 128);
+  }
 
-          int iiiiii = 0;
-        }*/
+  SECTION("Blocks released by other threads are returned to their owner")
+  {
+    auto block = detail::allocate_recycled(1000);
+    std::thread([block]
+    {
+      detail::deallocate_recycled(block, 1000);
+    }).join();
+    auto recycled = detail::allocate_recycled(1000);
+    CHECK(recycled == block);
+    detail::deallocate_recycled(recycled, 1000);
+  }
+}
 
-        system_scheduler().post([]
+TEST_CASE("Await all tests", "[await_all]")
+{
+  SECTION("Variadic futures are awaited at once")
+  {
+    auto future = awaitify([]
+    {
+      auto results = await_all(
+        invoke([] { return 1; }),
+        invoke([] { return std::string("2"); }),
+        invoke([] { }),
+        boost::make_ready_future(true));
+      return (std::get<0>(results) == 1) &&
+             (std::get<1>(results) == "2") &&
+             std::get<3>(results);
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Ranges of futures are awaited at once")
+  {
+    auto future = awaitify([]
+    {
+      std::vector<future_t<int>> futures;
+      for (int i = 0; i < 10; ++i)
+        futures.push_back(invoke([i] { return i; }));
+
+      auto results = await_all(std::move(futures));
+      return std::accumulate(results.begin(), results.end(), 0);
+    });
+    CHECK(future.get() == 45);
+  }
+
+  SECTION("Ready futures don't suspend the context")
+  {
+    auto future = awaitify([]
+    {
+      std::vector<future_t<int>> futures;
+      futures.push_back(boost::make_ready_future(1));
+      futures.push_back(boost::make_ready_future(2));
+      return await_all(futures).size();
+    });
+    CHECK(future.get() == 2);
+  }
+}
+
+TEST_CASE("Await any tests", "[await_any]")
+{
+  SECTION("The first completed future resumes the context")
+  {
+    auto future = awaitify([]
+    {
+      promise_t<int> never;
+      auto result = await_any(never.get_future(),
+                              invoke([] { return 2; }));
+      return (result.index == 1) && (result.value == 2);
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("The producers of the losers are cancelled")
+  {
+    auto future = awaitify([]
+    {
+      cancellation cancel;
+      auto slow = std::make_shared<promise_t<int>>();
+      cancel.on_cancel([slow]
+      {
+        slow->set_exception(std::make_exception_ptr(
+          std::runtime_error("cancelled")));
+      });
+
+      std::vector<future_t<int>> futures;
+      futures.push_back(slow->get_future());
+      futures.push_back(invoke([] { return 1; }));
+      auto result = await_any(cancel, std::move(futures));
+      return (result.index == 1) && cancel.is_cancelled();
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Ready futures win immediately")
+  {
+    auto future = awaitify([]
+    {
+      promise_t<void> never;
+      auto result = await_any(never.get_future(),
+                              boost::make_ready_future());
+      return result.index;
+    });
+    CHECK(future.get() == 1);
+  }
+}
+
+TEST_CASE("Await timeout tests", "[await_for]")
+{
+  SECTION("Futures completed before the deadline return their value")
+  {
+    auto future = awaitify([]
+    {
+      auto result = await_for(std::chrono::seconds(10),
+                              invoke([] { return 1; }));
+      return result && (*result == 1);
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Expired deadlines resume the context without a value")
+  {
+    auto promise = std::make_shared<promise_t<int>>();
+    auto future = awaitify([promise]
+    {
+      auto result = await_for(std::chrono::milliseconds(10),
+                              promise->get_future());
+      return !result;
+    });
+    CHECK(future.get());
+
+    // A late completion is dropped
+    promise->set_value(1);
+  }
+
+  SECTION("Expired deadlines don't suspend the context")
+  {
+    auto future = awaitify([]
+    {
+      promise_t<void> never;
+      return !await_until(std::chrono::steady_clock::now(),
+                          never.get_future());
+    });
+    CHECK(future.get());
+  }
+}
+
+TEST_CASE("Timer tests", "[timer]")
+{
+  using clock = std::chrono::steady_clock;
+
+  SECTION("Sleeping contexts are resumed after the duration")
+  {
+    auto future = awaitify([]
+    {
+      auto const begin = clock::now();
+      sleep_for(std::chrono::milliseconds(20));
+      return clock::now() - begin;
+    });
+    CHECK(future.get() >= std::chrono::milliseconds(20));
+  }
+
+  SECTION("Sleeping contexts don't require the system scheduler")
+  {
+    executor scheduler;
+    runtime worker(scheduler, { 1 });
+    worker.start();
+
+    // Occupies every worker of the system scheduler
+    auto release = std::make_shared<boost::promise<void>>();
+    boost::shared_future<void> released = release->get_future().share();
+    auto blocked = std::make_shared<std::atomic<std::size_t>>(0);
+    for (std::size_t i = 0; i < system_workers; ++i)
+      system_scheduler().post([released, blocked]
+      {
+        ++*blocked;
+        released.wait();
+      });
+    while (*blocked < system_workers)
+      std::this_thread::yield();
+
+    auto future = awaitify(scheduler, []
+    {
+      sleep_for(std::chrono::milliseconds(5));
+      return true;
+    });
+    bool const resumed = future.wait_for(boost::chrono::seconds(5)) ==
+      boost::future_status::ready;
+    release->set_value();
+    CHECK(resumed);
+    CHECK(future.get());
+
+    worker.stop();
+    worker.join();
+  }
+
+  SECTION("Timers expire in order of their deadlines")
+  {
+    struct recorder
+    {
+      std::mutex mutex;
+      std::vector<int> expired;
+      // Outlives the recorder while the last timer signals it
+      std::shared_ptr<boost::promise<void>> done =
+        std::make_shared<boost::promise<void>>();
+    } record;
+
+    struct timer
+    {
+      int id;
+      recorder* record;
+      detail::timer_entry entry;
+
+      timer(int id_, recorder* record_)
+        : id(id_), record(record_), entry(&timer::on_timer, this) { }
+
+      static void on_timer(void* data, bool expired)
+      {
+        auto const self = static_cast<timer*>(data);
+        if (!expired)
+          return;
+
+        std::shared_ptr<boost::promise<void>> done;
         {
-          awaitify([]
-          {
-            await invoke([] { return 0; });
-          });
-        });
-    }
+          std::lock_guard<std::mutex> lock(self->record->mutex);
+          self->record->expired.push_back(self->id);
+          if (self->record->expired.size() == 3)
+            done = self->record->done;
+        }
+        if (done)
+          done->set_value();
+      }
+    };
 
-    int iiiii = 0;
+    // The deadlines are spread over the levels of the wheel
+    timer late(130, &record), early(5, &record), middle(70, &record),
+          cancelled(10, &record);
+
+    auto const begin = clock::now();
+    for (auto current : { &late, &early, &middle, &cancelled })
+      detail::schedule_timer(current->entry,
+        begin + std::chrono::milliseconds(current->id));
+    CHECK(detail::cancel_timer(cancelled.entry));
+
+    record.done->get_future().get();
+    CHECK(clock::now() - begin >= std::chrono::milliseconds(130));
+    CHECK((record.expired == std::vector<int>{ 5, 70, 130 }));
+    CHECK_FALSE(detail::cancel_timer(late.entry));
   }
 }
 
-TEST_CASE("Executor suspender", "[executor]")
+TEST_CASE("Asio completion token tests", "[use_await]")
 {
-  SECTION("Stop the executor")
+  SECTION("Operations without a result return void")
+  {
+    auto future = awaitify([]
+    {
+      boost::asio::steady_timer timer(asio_service(),
+                                      std::chrono::milliseconds(1));
+      timer.async_wait(use_await);
+      return true;
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Operations return their result")
+  {
+    auto future = awaitify([]
+    {
+      boost::asio::local::stream_protocol::socket left(asio_service()),
+                                                  right(asio_service());
+      boost::asio::local::connect_pair(left, right);
+
+      std::string const message = "awaitify";
+      std::size_t const written = boost::asio::async_write(left,
+        boost::asio::buffer(message), use_await);
+
+      std::string received(message.size(), '\0');
+      std::size_t const read = boost::asio::async_read(right,
+        boost::asio::buffer(&received[0], received.size()), use_await);
+      return (written == message.size()) && (read == message.size()) &&
+             (received == message);
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Errors are thrown as system_error")
   {
-    work.reset();
-    system_scheduler().stop();
+    auto future = awaitify([]
+    {
+      boost::asio::local::stream_protocol::socket left(asio_service()),
+                                                  right(asio_service());
+      boost::asio::local::connect_pair(left, right);
+      left.close();
+
+      char buffer[1];
+      try
+      {
+        right.async_read_some(boost::asio::buffer(buffer), use_await);
+      }
+      catch (boost::system::system_error const& error)
+      {
+        return error.code() == boost::asio::error::eof;
+      }
+      return false;
+    });
+    CHECK(future.get());
+  }
+}
+
+namespace {
+  /// User defined awaitable which is ready once it was notified
+  class notification
+  {
+    struct state
+    {
+      std::mutex mutex;
+      bool notified = false;
+      std::function<void()> waiter;
+    };
+
+    std::shared_ptr<state> state_ = std::make_shared<state>();
+
+  public:
+    bool is_notified() const
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      return state_->notified;
+    }
+
+    void notify()
+    {
+      std::function<void()> waiter;
+      {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->notified = true;
+        waiter = std::move(state_->waiter);
+      }
+      if (waiter)
+        waiter();
+    }
+
+    void on_notify(std::function<void()> waiter)
+    {
+      {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (!state_->notified)
+        {
+          state_->waiter = std::move(waiter);
+          return;
+        }
+      }
+      waiter();
+    }
+  };
+} // namespace
+
+namespace awf {
+  template<>
+  struct awaitable_traits<notification>
+  {
+    static bool is_ready(notification& awaitable)
+    {
+      return awaitable.is_notified();
+    }
+
+    template<typename Callback>
+    static void on_ready(notification& awaitable, Callback&& callback)
+    {
+      awaitable.on_notify(std::forward<Callback>(callback));
+    }
+
+    static void get_result(notification&) { }
+  };
+} // namespace awf
+
+TEST_CASE("Awaitable traits tests", "[awaitable_traits]")
+{
+  SECTION("std::future is awaitable")
+  {
+    auto future = awaitify([]
+    {
+      auto promise = std::make_shared<std::promise<int>>();
+      auto result = promise->get_future();
+      system_scheduler().post([promise]
+      {
+        promise->set_value(1);
+      });
+      return await std::move(result);
+    });
+    CHECK(future.get() == 1);
+  }
+
+  SECTION("boost::shared_future is awaitable and stays valid")
+  {
+    auto future = awaitify([]
+    {
+      auto result = invoke([] { return 1; }).share();
+      auto const first = await result;
+      return first + result.get();
+    });
+    CHECK(future.get() == 2);
+  }
+
+  SECTION("asio timers are awaitable")
+  {
+    auto future = awaitify([]
+    {
+      boost::asio::steady_timer timer(asio_service(),
+                                      std::chrono::milliseconds(5));
+      await timer;
+      return std::chrono::steady_clock::now() >= timer.expiry();
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("User defined types are awaitable")
+  {
+    notification signal;
+    auto future = awaitify([signal]() mutable
+    {
+      await signal;
+      return true;
+    });
+    system_scheduler().post([signal]() mutable
+    {
+      signal.notify();
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("await_any and await_for accept every awaitable")
+  {
+    auto future = awaitify([]
+    {
+      std::promise<int> never;
+      auto promise = std::make_shared<std::promise<int>>();
+      system_scheduler().post([promise]
+      {
+        promise->set_value(1);
+      });
+      auto const any = await_any(never.get_future(), promise->get_future());
+
+      notification signal;
+      system_scheduler().post([signal]() mutable
+      {
+        signal.notify();
+      });
+      auto const notified = await_for(std::chrono::seconds(10), signal);
+      return (any.index == 1) && (any.value == 1) && bool(notified);
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Awaitables of different kinds are awaited together")
+  {
+    auto future = awaitify([]
+    {
+      auto promise = std::make_shared<std::promise<int>>();
+      auto first = promise->get_future();
+      system_scheduler().post([promise]
+      {
+        promise->set_value(1);
+      });
+      boost::asio::steady_timer timer(asio_service(),
+                                      std::chrono::milliseconds(1));
+      auto results = await_all(std::move(first),
+                               invoke([] { return 2; }),
+                               std::move(timer));
+      return std::get<0>(results) + std::get<1>(results);
+    });
+    CHECK(future.get() == 3);
+  }
+}
+
+TEST_CASE("Work stealing executor tests", "[work_stealing_executor]")
+{
+  SECTION("run() returns once the executor ran out of work")
+  {
+    work_stealing_executor executor;
+    std::atomic<std::size_t> invoked(0);
+    for (std::size_t i = 0; i < 1000; ++i)
+      executor.post([&] { ++invoked; });
+
+    CHECK(executor.run() == 1000);
+    CHECK(invoked == 1000);
+  }
+
+  SECTION("Tasks posted from tasks are executed by all threads")
+  {
+    work_stealing_executor executor;
+    std::atomic<std::size_t> invoked(0);
+    std::function<void(std::size_t)> spawn = [&](std::size_t depth)
+    {
+      ++invoked;
+      if (depth)
+        for (int i = 0; i < 4; ++i)
+          executor.post([&spawn, depth] { spawn(depth - 1); });
+    };
+    executor.post([&] { spawn(6); });
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+      threads.emplace_back([&] { executor.run(); });
+    for (auto& thread : threads)
+      thread.join();
+
+    // 4^0 + 4^1 + ... + 4^6
+    CHECK(invoked == 5461);
+  }
+
+  SECTION("dispatch() invokes the function in place on executor threads")
+  {
+    work_stealing_executor executor;
+    bool in_place = false;
+    executor.post([&]
+    {
+      bool invoked = false;
+      executor.dispatch([&] { invoked = true; });
+      in_place = invoked;
+    });
+    executor.run();
+
+    CHECK(in_place);
+    CHECK_FALSE(executor.running_in_this_thread());
+  }
+
+  SECTION("post_to() keeps tasks on the worker while it keeps up")
+  {
+    // A preempted worker isn't taken over within the test
+    work_stealing_executor executor(0, std::chrono::hours(1));
+    CHECK(executor.current_worker() == work_stealing_executor::no_worker);
+
+    std::vector<std::size_t> workers;
+    std::function<void(std::size_t)> step = [&](std::size_t remaining)
+    {
+      workers.push_back(executor.current_worker());
+      if (remaining)
+        executor.post_to(executor.current_worker(),
+                         [&step, remaining] { step(remaining - 1); });
+    };
+    executor.post([&] { step(100); });
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+      threads.emplace_back([&] { executor.run(); });
+    for (auto& thread : threads)
+      thread.join();
+
+    REQUIRE(workers.size() == 101);
+    CHECK(std::count(workers.begin(), workers.end(), workers.front()) == 101);
+  }
+
+  SECTION("Backlogged mailboxes are taken over by other threads")
+  {
+    work_stealing_executor executor;
+    std::atomic<std::size_t> invoked(0);
+    std::atomic<bool> release(false);
+    executor.post([&]
+    {
+      // Blocks the worker while its mailbox fills up
+      for (int i = 0; i < 100; ++i)
+        executor.post_to(executor.current_worker(), [&] { ++invoked; });
+      while (invoked < 100)
+        std::this_thread::yield();
+      release = true;
+    });
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i)
+      threads.emplace_back([&] { executor.run(); });
+    for (auto& thread : threads)
+      thread.join();
+
+    CHECK(release);
+  }
+
+  SECTION("stop() returns from run() despite outstanding work")
+  {
+    work_stealing_executor executor;
+    work_stealing_executor::work work(executor);
+    executor.post([&] { executor.stop(); });
+    executor.run();
+
+    CHECK(executor.stopped());
+  }
+
+  SECTION("Threads beyond the capacity are rejected")
+  {
+    work_stealing_executor executor(1);
+    work_stealing_executor::work work(executor);
+    bool rejected = false;
+    executor.post([&]
+    {
+      std::thread([&]
+      {
+        try
+        {
+          executor.run();
+        }
+        catch (std::length_error const&)
+        {
+          rejected = true;
+        }
+      }).join();
+      executor.stop();
+    });
+    executor.run();
+
+    CHECK(rejected);
+    CHECK(work_stealing_executor().capacity() >=
+          std::thread::hardware_concurrency());
+  }
+}
+
+TEST_CASE("Runtime tests", "[runtime]")
+{
+  executor scheduler;
+
+  SECTION("Workers run the executor until the runtime is stopped")
+  {
+    runtime workers(scheduler, { 2, true, "awf-test" });
+    workers.start();
+    CHECK(workers.size() == 2);
+
+    auto names = std::make_shared<promise_t<std::string>>();
+    auto name = names->get_future();
+    scheduler.post([names]
+    {
+    #ifdef __linux__
+      char buffer[16] = { };
+      pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+      names->set_value(buffer);
+    #else
+      names->set_value("awf-test-0");
+    #endif // __linux__
+    });
+    CHECK(name.get().compare(0, 9, "awf-test-") == 0);
+
+    workers.stop();
+    workers.join();
+    CHECK(scheduler.stopped());
+    CHECK(workers.size() == 0);
+  }
+
+  SECTION("Runtimes can be restarted")
+  {
+    runtime workers(scheduler, { 1 });
+    for (int i = 0; i < 2; ++i)
+    {
+      workers.start();
+      auto result = std::make_shared<promise_t<int>>();
+      auto future = result->get_future();
+      scheduler.post([result, i] { result->set_value(i); });
+      CHECK(future.get() == i);
+      workers.stop();
+      workers.join();
+    }
+  }
+}
+
+namespace {
+  /// Returns the name of the calling thread
+  std::string current_thread_name()
+  {
+  #ifdef __linux__
+    char buffer[16] = { };
+    pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+    return buffer;
+  #else
+    return "";
+  #endif // __linux__
+  }
+} // namespace
+
+TEST_CASE("Independent executor tests", "[executor]")
+{
+  executor latency;
+  executor batch;
+  runtime latency_workers(latency, { 2, false, "awf-latency" });
+  runtime batch_workers(batch, { 2, false, "awf-batch" });
+  latency_workers.start();
+  batch_workers.start();
+
+  auto runs_on = [](char const* prefix)
+  {
+  #ifdef __linux__
+    return current_thread_name().compare(0, std::strlen(prefix), prefix) == 0;
+  #else
+    (void)prefix;
+    return true;
+  #endif // __linux__
+  };
+
+  SECTION("Contexts are resumed on the executor they were spawned on")
+  {
+    auto future = awaitify(latency, [&]
+    {
+      bool owned = runs_on("awf-latency") &&
+        (&current_execution_context()->scheduler() == &latency);
+      for (int i = 0; i < 20; ++i)
+      {
+        // Completed on the system scheduler
+        await invoke([] { });
+        owned = owned && runs_on("awf-latency");
+      }
+      return owned;
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Nested contexts inherit the executor of their parent")
+  {
+    auto future = awaitify(batch, [&]
+    {
+      auto const nested = await awaitify([&]
+      {
+        return runs_on("awf-batch");
+      });
+      auto const foreign = await awaitify(latency, [&]
+      {
+        return runs_on("awf-latency");
+      });
+      return nested && foreign && runs_on("awf-batch");
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Executors are stopped independently")
+  {
+    batch_workers.stop();
+    batch_workers.join();
+    CHECK(awaitify(latency, [] { return 1; }).get() == 1);
+  }
+}
+
+TEST_CASE("Priority tests", "[priority]")
+{
+  executor scheduler;
+  runtime worker(scheduler, { 1 });
+  worker.start();
+
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto record = [&](std::string name)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    order.push_back(std::move(name));
+  };
+
+  // Keeps the worker busy while the contexts are spawned
+  std::atomic<bool> released(false);
+  scheduler.post([&]
+  {
+    while (!released)
+      std::this_thread::yield();
+  });
+
+  SECTION("High priority contexts run in front of queued normal work")
+  {
+    std::vector<future_t<void>> futures;
+    for (int i = 0; i < 10; ++i)
+      futures.push_back(awaitify(scheduler, [&] { record("normal"); }));
+    futures.push_back(awaitify(scheduler, priority::high, [&]
+    {
+      record("high");
+    }));
+    released = true;
+    for (auto& future : futures)
+      future.get();
+
+    REQUIRE(order.size() == 11);
+    CHECK(order.front() == "high");
+  }
+
+  SECTION("Low priority contexts are deferred behind queued normal work")
+  {
+    std::vector<future_t<void>> futures;
+    futures.push_back(awaitify(scheduler, priority::low, [&]
+    {
+      record("low");
+    }));
+    for (int i = 0; i < 10; ++i)
+      futures.push_back(awaitify(scheduler, [&] { record("normal"); }));
+    released = true;
+    for (auto& future : futures)
+      future.get();
+
+    REQUIRE(order.size() == 11);
+    CHECK(order.back() == "low");
+  }
+
+  SECTION("Resumptions and nested contexts inherit the priority")
+  {
+    released = true;
+    auto const before = priority_statistics(priority::high);
+    auto future = awaitify(scheduler, priority::high, []
+    {
+      auto const nested = await awaitify([]
+      {
+        return current_execution_context()->get_priority();
+      });
+      await invoke([] { });
+      return (nested == priority::high) &&
+        (current_execution_context()->get_priority() == priority::high);
+    });
+    CHECK(future.get());
+
+    auto const after = priority_statistics(priority::high);
+    // The spawns and resumptions of both contexts
+    CHECK(after.dequeued - before.dequeued >= 3);
+    CHECK(after.max_wait >= before.max_wait);
+  }
+
+  SECTION("Prioritized contexts of destroyed executors are released")
+  {
+    released = true;
+    // The live contexts are only counted while a limit is configured
+    auto const admission = admission_configuration();
+    configure_admission({ 64, admission_policy::fail });
+    auto const live = admission_statistics().live;
+    auto token = std::make_shared<int>(0);
+    {
+      executor destroyed;
+      awaitify(destroyed, priority::high, [token] { });
+      spawn_detached(destroyed, priority::low, [token] { });
+      CHECK(token.use_count() == 3);
+      CHECK(admission_statistics().live == live + 2);
+    }
+    CHECK(token.use_count() == 1);
+    CHECK(admission_statistics().live == live);
+    configure_admission(admission);
+  }
+
+  released = true;
+  worker.stop();
+  worker.join();
+}
+
+TEST_CASE("Sharded runtime tests", "[sharded_runtime]")
+{
+  sharded_runtime shards({ 3 });
+  shards.start();
+  REQUIRE(shards.size() == 3);
+  CHECK(current_shard() == nullptr);
+
+  SECTION("Contexts are never resumed on another thread")
+  {
+    auto future = awaitify(shards[0], [&]
+    {
+      // The thread id could be reused by the compiler across awaits,
+      // the shard of the thread is looked up out of line.
+      bool pinned = current_shard() == &shards[0];
+      for (int i = 0; i < 20; ++i)
+      {
+        await invoke([] { });
+        pinned = pinned && (current_shard() == &shards[0]);
+      }
+      sleep_for(std::chrono::milliseconds(1));
+      return pinned && (current_shard() == &shards[0]);
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Cross-shard calls return awaitable futures")
+  {
+    auto future = awaitify(shards[0], [&]
+    {
+      std::size_t sum = 0;
+      for (std::size_t i = 0; i < 1000; ++i)
+        sum += await awaitify(shards[1 + (i % 2)], []
+        {
+          return current_shard()->index();
+        });
+      return (current_shard() == &shards[0]) ? sum : 0;
+    });
+    // 500 * 1 + 500 * 2
+    CHECK(future.get() == 1500);
+  }
+
+  SECTION("Asio operations of other executors resume the context on its shard")
+  {
+    auto future = awaitify(shards[0], [&]
+    {
+      bool pinned = true;
+      for (int i = 0; i < 5; ++i)
+      {
+        boost::asio::steady_timer timer(asio_service(),
+                                        std::chrono::milliseconds(1));
+        timer.async_wait(use_await);
+        pinned = pinned && (current_shard() == &shards[0]);
+      }
+      return pinned;
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Contexts spawned from a shard stay on it")
+  {
+    auto future = awaitify(shards[2], []
+    {
+      return await awaitify([] { return current_shard()->index(); });
+    });
+    CHECK(future.get() == 2);
+  }
+
+  shards.stop();
+  shards.join();
+}
+
+TEST_CASE("Idle strategy tests", "[idle]")
+{
+  auto const options = idle_configuration();
+
+  SECTION("Idle threads spin and yield before they park")
+  {
+    auto const before = idle_statistics();
+    configure_idle({ std::chrono::microseconds(200),
+                     std::chrono::microseconds(200) });
+
+    auto future = awaitify([]
+    {
+      for (int i = 0; i < 5; ++i)
+        sleep_for(std::chrono::milliseconds(2));
+      return true;
+    });
+    CHECK(future.get());
+
+    auto const after = idle_statistics();
+    CHECK(after.spins > before.spins);
+    CHECK(after.yields > before.yields);
+    CHECK(after.parks > before.parks);
+    CHECK(after.wakeups >= before.wakeups);
+  }
+
+  SECTION("The work-stealing executor applies the idle strategy")
+  {
+    configure_idle({ std::chrono::microseconds(200),
+                     std::chrono::microseconds(0) });
+    auto const before = idle_statistics();
+
+    work_stealing_executor executor;
+    std::atomic<bool> ready(false);
+    std::thread worker;
+    {
+      work_stealing_executor::work work(executor);
+      worker = std::thread([&] { executor.run(); });
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      executor.post([&] { ready = true; });
+    }
+    worker.join();
+
+    CHECK(ready);
+    CHECK(idle_statistics().spins > before.spins);
+  }
+
+  configure_idle(options);
+}
+
+namespace {
+  /// Future which reports when a context suspended on it,
+  /// so it's completed after the suspension without sleeping.
+  template<typename T>
+  class awaited_future
+  {
+    future_t<T> future_;
+    std::shared_ptr<std::promise<void>> awaited_;
+    std::shared_future<void> on_awaited_;
+
+  public:
+    explicit awaited_future(future_t<T> future)
+      : future_(std::move(future)),
+        awaited_(std::make_shared<std::promise<void>>()),
+        on_awaited_(awaited_->get_future()) { }
+
+    /// Returns a future which is ready once a context awaits this future
+    std::shared_future<void> awaited() const { return on_awaited_; }
+
+    future_t<T>& future() noexcept { return future_; }
+    std::shared_ptr<std::promise<void>> const& observer() const noexcept
+    {
+      return awaited_;
+    }
+  };
+} // namespace
+
+namespace awf {
+  template<typename T>
+  struct awaitable_traits<awaited_future<T>>
+  {
+    static bool is_ready(awaited_future<T>& awaitable)
+    {
+      return awaitable.future().is_ready();
+    }
+
+    template<typename Callback>
+    static void on_ready(awaited_future<T>& awaitable, Callback&& callback)
+    {
+      // The awaitable is released by the resumption
+      // which may happen right after the notification.
+      auto const observer = awaitable.observer();
+      awaitable_traits<future_t<T>>::on_ready(awaitable.future(),
+        std::forward<Callback>(callback));
+      observer->set_value();
+    }
+
+    static T get_result(awaited_future<T>& awaitable)
+    {
+      return awaitable.future().get();
+    }
+  };
+} // namespace awf
+
+TEST_CASE("Resume mode tests", "[resume]")
+{
+  auto const options = resume_configuration();
+  configure_resume({ resume_mode::dispatch, options.max_depth });
+
+  SECTION("Contexts are resumed directly from scheduler threads")
+  {
+    auto future = awaitify([]
+    {
+      auto promise = std::make_shared<promise_t<std::thread::id>>();
+      awaited_future<std::thread::id> completion(promise->get_future());
+      system_scheduler().post([promise, awaited = completion.awaited()]
+      {
+        // Completes the future after the context suspended on it
+        awaited.wait();
+        promise->set_value(std::this_thread::get_id());
+      });
+      auto const completing = await std::move(completion);
+      return completing == current_thread_id();
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Contexts completed from foreign threads are posted")
+  {
+    auto future = awaitify([]
+    {
+      auto promise = std::make_shared<promise_t<std::thread::id>>();
+      auto completion = promise->get_future();
+      std::thread([promise]
+      {
+        promise->set_value(std::this_thread::get_id());
+      }).detach();
+      auto const completing = await std::move(completion);
+      return completing != current_thread_id();
+    });
+    CHECK(future.get());
+  }
+
+  SECTION("Directly resumed contexts are bounded in their depth")
+  {
+    configure_resume({ resume_mode::dispatch, 2 });
+    auto future = awaitify([]
+    {
+      int sum = 0;
+      for (int i = 0; i < 100; ++i)
+      {
+        sum += await invoke([] { return 1; });
+        if (resume_depth() > 2)
+          return -1;
+      }
+      return sum;
+    });
+    CHECK(future.get() == 100);
+  }
+
+  SECTION("Chained completions resume directly up to the depth")
+  {
+    configure_resume({ resume_mode::dispatch, 2 });
+    // Completing promises may still be in use after the awaiting
+    // context finished, they are shared with the completing sides.
+    auto promises = std::make_shared<std::array<promise_t<void>, 3>>();
+    std::array<std::size_t, 3> depths{};
+
+    // Every context completes the future of the next one in place
+    std::vector<future_t<void>> chain;
+    std::vector<std::shared_future<void>> suspended;
+    for (std::size_t i = 0; i < promises->size(); ++i)
+    {
+      awaited_future<void> completion((*promises)[i].get_future());
+      suspended.push_back(completion.awaited());
+      chain.push_back(awaitify(
+        [&depths, promises, i, completion = std::move(completion)] () mutable
+      {
+        await std::move(completion);
+        depths[i] = resume_depth();
+        if (i + 1 < promises->size())
+          (*promises)[i + 1].set_value();
+      }));
+    }
+
+    // The chain is started after all contexts suspended
+    for (auto& awaited : suspended)
+      awaited.wait();
+    system_scheduler().post([promises] { (*promises)[0].set_value(); });
+    for (auto& future : chain)
+      future.get();
+
+    // The third resumption exceeds the depth and is posted
+    CHECK((depths == std::array<std::size_t, 3>{ 1, 2, 0 }));
+  }
+
+  SECTION("Resumptions and migrations are counted")
+  {
+    auto const before = resume_statistics();
+    auto future = awaitify([]
+    {
+      auto const started = current_thread_id();
+      auto promise = std::make_shared<promise_t<void>>();
+      auto completion = promise->get_future();
+      std::thread([promise]
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        promise->set_value();
+      }).detach();
+      await std::move(completion);
+      return started != current_thread_id();
+    });
+    auto const migrated = future.get();
+    auto const after = resume_statistics();
+
+    CHECK(after.resumes > before.resumes);
+    CHECK(after.migrations - before.migrations <=
+          after.resumes - before.resumes);
+    if (migrated)
+      CHECK(after.migrations > before.migrations);
+  }
+
+  configure_resume(options);
+}
+
+TEST_CASE("Yield tests", "[yield]")
+{
+  auto const options = budget_configuration();
+  executor scheduler;
+  std::vector<char> order;
+
+  auto spawn = [&](char name, auto step)
+  {
+    return awaitify(scheduler, [&, name, step]
+    {
+      for (int i = 0; i < 4; ++i)
+      {
+        step();
+        order.push_back(name);
+      }
+    });
+  };
+
+  SECTION("yield() gives way to the pending work of the executor")
+  {
+    auto first = spawn('a', [] { yield(); });
+    auto second = spawn('b', [] { yield(); });
+    scheduler.run();
+    first.get();
+    second.get();
+    CHECK(std::string(order.begin(), order.end()) == "abababab");
+  }
+
+  SECTION("yield() outside of a context returns")
+  {
+    yield();
+    CHECK_FALSE(current_execution_context());
+  }
+
+  SECTION("Run budgets are disabled by default")
+  {
+    CHECK(options.ready_awaits == 0);
+    CHECK(options.run_time.count() == 0);
+  }
+
+  SECTION("Ready awaits don't yield within the budget")
+  {
+    configure_budget({ 0, std::chrono::microseconds(0) });
+    auto first = spawn('a', [] { await make_ready_future(); });
+    auto second = spawn('b', [] { await make_ready_future(); });
+    scheduler.run();
+    first.get();
+    second.get();
+    CHECK(std::string(order.begin(), order.end()) == "aaaabbbb");
+  }
+
+  SECTION("Ready awaits yield once the budget is exhausted")
+  {
+    configure_budget({ 1, std::chrono::microseconds(0) });
+    auto const before = resume_statistics();
+    auto first = spawn('a', [] { await make_ready_future(); });
+    auto second = spawn('b', [] { await make_ready_future(); });
+    scheduler.run();
+    first.get();
+    second.get();
+    // Every second ready await yields
+    CHECK(std::string(order.begin(), order.end()) == "abaabbab");
+    CHECK(resume_statistics().preemptions - before.preemptions == 4);
+  }
+
+  SECTION("Ready awaits yield once the run time is exhausted")
+  {
+    configure_budget({ 0, std::chrono::microseconds(1) });
+    auto first = spawn('a', []
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      await make_ready_future();
+    });
+    auto second = spawn('b', []
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      await make_ready_future();
+    });
+    scheduler.run();
+    first.get();
+    second.get();
+    CHECK(std::string(order.begin(), order.end()) == "abababab");
+  }
+
+  configure_budget(options);
+}
+
+TEST_CASE("Admission tests", "[admission]")
+{
+  auto const options = admission_configuration();
+  auto const before = admission_statistics();
+  executor scheduler;
+
+  SECTION("Spawns aren't counted without a limit")
+  {
+    configure_admission({ 0, admission_policy::fail });
+    auto future = awaitify(scheduler, [] { });
+    CHECK(admission_statistics().live == before.live);
+    scheduler.run();
+    future.get();
+    CHECK(admission_statistics().live == before.live);
+  }
+
+  SECTION("Slots are released after the context was unwound")
+  {
+    configure_admission({ before.live + 1, admission_policy::fail });
+    std::size_t unwound = 0;
+    {
+      // Records the live contexts when the capture is destroyed
+      std::shared_ptr<void> probe(nullptr, [&](void*)
+      {
+        unwound = admission_statistics().live;
+      });
+
+      executor dropped;
+      awaitify(dropped, [probe, &dropped]
+      {
+        dropped.stop();
+        yield();
+      });
+      probe.reset();
+      dropped.run();
+    }
+    CHECK(unwound == before.live + 1);
+    CHECK(admission_statistics().live == before.live);
+  }
+
+  SECTION("Spawns beyond the limit fail fast")
+  {
+    configure_admission({ before.live + 1, admission_policy::fail });
+    auto first = awaitify(scheduler, [] { });
+    CHECK_THROWS_AS(awaitify(scheduler, [] { }), admission_error const&);
+    CHECK(admission_statistics().rejected == before.rejected + 1);
+
+    scheduler.run();
+    first.get();
+    CHECK(admission_statistics().live == before.live);
+  }
+
+  SECTION("Spawns from contexts await a free slot")
+  {
+    configure_admission({ before.live + 2, admission_policy::wait });
+    std::size_t max_live = 0;
+    auto parent = awaitify(scheduler, [&]
+    {
+      std::vector<future_t<void>> children;
+      for (int i = 0; i < 8; ++i)
+        children.push_back(awaitify([&]
+        {
+          max_live = std::max(max_live, admission_statistics().live);
+        }));
+    });
+    scheduler.run();
+    parent.get();
+
+    CHECK(max_live == before.live + 2);
+    CHECK(admission_statistics().awaited == before.awaited + 7);
+  }
+
+  SECTION("Spawns from other threads block until a slot is free")
+  {
+    configure_admission({ before.live + 1, admission_policy::wait });
+    auto first = awaitify(scheduler, [] { });
+    future_t<int> second;
+    std::thread spawner([&]
+    {
+      second = awaitify(scheduler, [] { return 1; });
+    });
+    while (admission_statistics().blocked == before.blocked)
+      std::this_thread::yield();
+
+    // Completing the first context admits the second spawn
+    scheduler.run();
+    spawner.join();
+    scheduler.restart();
+    scheduler.run();
+    first.get();
+    CHECK(second.get() == 1);
+  }
+
+  configure_admission(options);
+}
+
+namespace {
+  /// Task which reports whether it's stored on the coroutine stack
+  template<std::size_t Size>
+  struct located_task
+  {
+    std::array<char, Size> payload;
+
+    bool operator() () const
+    {
+      char local;
+      auto const stack_size = stack_pool_configuration().stack_size;
+      auto const self = reinterpret_cast<char const*>(this);
+      return (self > &local) && (self < &local + stack_size);
+    }
+  };
+
+  /// Counts the moves and copies of the task
+  struct counted_task
+  {
+    static int moves;
+    static int copies;
+
+    counted_task() = default;
+    counted_task(counted_task const&) { ++copies; }
+    counted_task(counted_task&&) { ++moves; }
+
+    void operator() () const { }
+  };
+
+  int counted_task::moves = 0;
+  int counted_task::copies = 0;
+} // namespace
+
+TEST_CASE("Task storage tests", "[task]")
+{
+  executor scheduler;
+
+  SECTION("The size of inline tasks is checked at compile-time")
+  {
+    CHECK(is_inline_task<located_task<AWAITIFY_TASK_BUFFER_SIZE>>::value);
+    CHECK_FALSE(
+      is_inline_task<located_task<AWAITIFY_TASK_BUFFER_SIZE + 1>>::value);
+  }
+
+  SECTION("Small tasks are stored at the top of the coroutine stack")
+  {
+    auto future = awaitify(scheduler, located_task<128>());
+    scheduler.run();
+    CHECK(future.get());
+  }
+
+  SECTION("Oversized tasks are stored on the heap")
+  {
+    auto future = awaitify(scheduler,
+      located_task<AWAITIFY_TASK_BUFFER_SIZE + 1>());
+    scheduler.run();
+    CHECK_FALSE(future.get());
+  }
+
+  SECTION("Contexts are placed at the top of their coroutine stack")
+  {
+    CHECK(is_inline_context<joinable_execution_context<int>>::value);
+    CHECK_FALSE((is_inline_context<joinable_execution_context<
+      std::array<char, AWAITIFY_CONTEXT_BUFFER_SIZE>>>::value));
+
+    auto handle = spawn(scheduler, []
+    {
+      char local;
+      auto const stack_size = stack_pool_configuration().stack_size;
+      auto const context =
+        reinterpret_cast<char const*>(current_execution_context());
+      return (context > &local) && (context < &local + stack_size);
+    });
+    scheduler.run();
+    CHECK(handle.get());
+  }
+
+  SECTION("Oversized contexts are stored on the heap")
+  {
+    auto handle = spawn(scheduler, []
+    {
+      std::array<char, AWAITIFY_CONTEXT_BUFFER_SIZE> result;
+      result.fill('x');
+      return result;
+    });
+    scheduler.run();
+    CHECK(handle.get().back() == 'x');
+  }
+
+  SECTION("Tasks are moved once into their context")
+  {
+    counted_task::moves = 0;
+    counted_task::copies = 0;
+    auto future = awaitify(scheduler, counted_task());
+    scheduler.run();
+    future.get();
+    CHECK(counted_task::moves == 1);
+    CHECK(counted_task::copies == 0);
+  }
+
+  SECTION("Tasks of contexts which never ran are released")
+  {
+    auto token = std::make_shared<int>(0);
+    {
+      executor stopped;
+      awaitify(stopped, [token] { });
+      // Exceeds the buffer together with the token
+      awaitify(stopped, [token, payload = located_task<
+        AWAITIFY_TASK_BUFFER_SIZE>()] { });
+      CHECK(token.use_count() == 3);
+    }
+    CHECK(token.use_count() == 1);
+  }
+}
+
+namespace {
+  /// Counts its moves and can't be copied
+  struct move_counted
+  {
+    static int moves;
+
+    move_counted() = default;
+    move_counted(move_counted const&) = delete;
+    move_counted(move_counted&&) { ++moves; }
+  };
+
+  int move_counted::moves = 0;
+} // namespace
+
+TEST_CASE("Join handle tests", "[spawn]")
+{
+  SECTION("Results are read through the handle")
+  {
+    auto handle = spawn([] { return 42; });
+    CHECK(handle.get() == 42);
+    CHECK_FALSE(handle.valid());
+  }
+
+  SECTION("Move-only results are supported")
+  {
+    auto handle = spawn([] { return std::make_unique<int>(7); });
+    auto const result = handle.get();
+    REQUIRE(result);
+    CHECK(*result == 7);
+  }
+
+  SECTION("Results are moved once")
+  {
+    move_counted::moves = 0;
+    auto handle = spawn([] { return move_counted(); });
+    auto const result = handle.get();
+    (void)result;
+    CHECK(move_counted::moves == 1);
+  }
+
+  SECTION("Handles are awaitable")
+  {
+    auto future = awaitify([]
+    {
+      auto first = spawn([] { return std::string("in-place"); });
+      auto second = spawn([] { });
+      await second;
+      return await first;
+    });
+    CHECK(future.get() == "in-place");
+  }
+
+  SECTION("Exceptions are rethrown by the handle")
+  {
+    auto handle = spawn([]() -> int
+    {
+      throw std::runtime_error("failed");
+    });
+    CHECK_THROWS_AS(handle.get(), std::runtime_error const&);
+  }
+}
+
+TEST_CASE("Detached spawn tests", "[detached]")
+{
+  auto const options = detached_configuration();
+  auto const before = admission_statistics();
+  executor scheduler;
+
+  SECTION("Detached contexts run their task to completion")
+  {
+    int steps = 0;
+    spawn_detached(scheduler, [&]
+    {
+      ++steps;
+      yield();
+      ++steps;
+      return steps;
+    });
+    scheduler.run();
+    CHECK(steps == 2);
+    CHECK(admission_statistics().live == before.live);
+  }
+
+  SECTION("Detached contexts are resumed by awaited futures")
+  {
+    auto promise = std::make_shared<promise_t<int>>();
+    auto completion = promise->get_future();
+    spawn_detached([promise]
+    {
+      promise->set_value(await invoke([] { return 1; }));
+    });
+    CHECK(completion.get() == 1);
+  }
+
+  SECTION("Exceptions of detached contexts are passed to the handler")
+  {
+    static std::atomic<int> caught(0);
+    caught = 0;
+    configure_detached({ [](std::exception_ptr exception)
+    {
+      try
+      {
+        std::rethrow_exception(exception);
+      }
+      catch (std::runtime_error const&)
+      {
+        ++caught;
+      }
+    } });
+
+    spawn_detached(scheduler, []
+    {
+      yield();
+      throw std::runtime_error("detached");
+    });
+    spawn_detached(scheduler, [] { });
+    scheduler.run();
+    CHECK(caught == 1);
+  }
+
+  configure_detached(options);
+}
+
+TEST_CASE("load test", "[executor]")
+{
+  SECTION("load")
+  {
+    for (int i = 0; i < 1000; ++i)
+    {
+        /*
+        try
+        {
+          awaitify([]
+          {
+            try
+            {
+
+              int res1 = await invoke([] { return 0; });
+            }
+            catch(std::exception const& e)
+            {
+              auto msg = e.what();
+
+              int iiiiii = 0;
+            }
+            // int res2 = await invoke([] { return 0; });
+          });
+        }
+        catch(std::exception const& e)
+        {
+          auto msg = e.what();
+
+          int iiiiii = 0;
+        }*/
+
+        system_scheduler().post([]
+        {
+          awaitify([]
+          {
+            await invoke([] { return 0; });
+          });
+        });
+    }
+
+    int iiiii = 0;
   }
 }